@@ -12,37 +12,296 @@
  *	 # To enable file readahead
  *	 echo 1 > /sys/module/no_fscache/parameters/readahead
  *
+ * NOTE: 'evict_read' and 'evict_write' are module parameters that
+ *	 enable/disable eliminating the caching effects of read and write
+ *	 system calls respectively. The default values are 'Y' (enabled).
+ *
+ *	 # To affect only the read system calls
+ *	 echo 0 > /sys/module/no_fscache/parameters/evict_write
+ *
+ *	 All these switches are implemented with static keys, so a disabled
+ *	 feature costs nothing more than a no-op instruction in the hooks.
+ *
+ *	 A page, or a transparent huge page, is evicted (or started to be
+ *	 written back) only after all of it has been accessed, so reading
+ *	 or writing a file sequentially in blocks smaller than a page does
+ *	 not read the same page from the device again. The partially read
+ *	 pages at the ends of a read are evicted with the next read of the
+ *	 file that continues them, or on their own when the next read does
+ *	 not continue them or the file is closed. The last page of the file
+ *	 is evicted right away.
+ *
  * NOTE: 'no_fscache_device' is a module parameter that specifies which storage
  *	 devices are affected by this module. Multiple devices can be specified
  *	 by a comma-separated list. The default value is "" meaning no device
- *	 is affected initially.
+ *	 is affected initially. Both the files on the devices and the devices
+ *	 themselves (e.g., dd if=/dev/sda) accessed without O_DIRECT are
+ *	 affected.
  *
  *	 # To disable file system cache for storage device sda
  *	 echo 'sda' > /sys/module/no_fscache/parameters/no_fscache_device
  *
  *	 # To disable file system cache for storage devices sda and sdb
  *	 echo 'sda,sdb' > /sys/module/no_fscache/parameters/no_fscache_device
+ *
+ *	 # To stop affecting any storage device
+ *	 echo '' > /sys/module/no_fscache/parameters/no_fscache_device
+ *
+ * NOTE: 'evict_policy' is a module parameter that selects when the pages read
+ *	 from the affected devices are evicted. The default value is 'always'.
+ *
+ *	 always		evict after every read.
+ *	 pressure	evict only when the page cache of the system exceeds
+ *			'cache_limit_pct' percent of the total memory, or when
+ *			the "some" memory pressure (avg10 of
+ *			/proc/pressure/memory) reaches 'psi_threshold' percent.
+ *			Setting a threshold to 0 disables it. The memory
+ *			state is sampled every 'pressure_interval_ms'
+ *			milliseconds. On a kernel with CONFIG_PSI, this
+ *			policy needs CONFIG_KALLSYMS_ALL to find the memory
+ *			pressure, and is rejected without it.
+ *
+ *	 # Evict only when page cache uses more than 30% of the memory
+ *	 echo 30 > /sys/module/no_fscache/parameters/cache_limit_pct
+ *	 echo pressure > /sys/module/no_fscache/parameters/evict_policy
+ *
+ * NOTE: 'deferred' is a module parameter that enables/disables running the
+ *	 eviction after reads and the write-back after writes in the 'start'
+ *	 mode from workers instead of the system calls. The work is queued to
+ *	 a queue of the device, for the NUMA node of the pages for eviction,
+ *	 and of the device for write-back. A pool of 'deferred_workers'
+ *	 kernel threads (0 means one per CPU, and at least one per node with
+ *	 CPUs) spread over the nodes drains the queues, preferring the work
+ *	 of their own node and stealing only a backlog. The threads are
+ *	 started when 'deferred' is enabled and stopped, after running the
+ *	 works left in the queues, when it is disabled. A system call
+ *	 waits when its device has 'deferred_max_depth' works queued (0 means
+ *	 no limit). The default value is 'N' (disabled). The queues and how
+ *	 many works ran on the node they were queued to are shown in
+ *	 /sys/kernel/debug/no_fscache/deferred.
+ *
+ *	 # Move eviction and write-back off the I/O path
+ *	 echo 1 > /sys/module/no_fscache/parameters/deferred
+ *
+ * NOTE: 'mrc' is a module parameter that enables/disables estimating the miss
+ *	 ratio curve of the I/Os to each affected device, i.e., the miss ratio
+ *	 the workload would have with a page cache of a given size. The
+ *	 default value is 'N' (disabled). Enabling it starts a new curve.
+ *
+ *	 # Start estimating and show the curves
+ *	 echo 1 > /sys/module/no_fscache/parameters/mrc
+ *	 cat /sys/kernel/debug/no_fscache/mrc
+ *
+ * NOTE: 'iotrace' is a module parameter that enables/disables recording the
+ *	 reads and writes to the affected devices into per-CPU ring buffers,
+ *	 which can be mapped from /sys/kernel/debug/no_fscache/trace/cpu<N>.
+ *	 The default value is 'N' (disabled). See no_fscache_trace.h for the
+ *	 format, and tools/trace for recording and replaying a trace.
+ *
+ *	 # Start tracing
+ *	 echo 1 > /sys/module/no_fscache/parameters/iotrace
+ *
+ * NOTE: To start an experiment from a known cache state, write a manifest of
+ *	 file ranges to /sys/kernel/debug/no_fscache/prewarm, one
+ *	 "<path> <offset> <length>" per line (a length of 0 means to the end of
+ *	 the file). The ranges are read into the page cache in parallel and
+ *	 are not evicted by this module until "clear" is written. Reading the
+ *	 file shows the progress, and reports a range as "partial" if not
+ *	 all of its pages could be cached, e.g., under memory pressure.
+ *
+ *	 # Cache the whole index file, and wait for it
+ *	 echo '/data/index 0 0' > /sys/kernel/debug/no_fscache/prewarm
+ *	 cat /sys/kernel/debug/no_fscache/prewarm
+ *
+ * NOTE: 'evict_on_close' is a module parameter that enables/disables writing
+ *	 back and evicting all the cached pages of a file on an affected
+ *	 device when the file is closed for the last time. The default value
+ *	 is 'N' (disabled).
+ *
+ *	 # Return the page cache of the files to empty after each close
+ *	 echo 1 > /sys/module/no_fscache/parameters/evict_on_close
+ *
+ * NOTE: 'evict_metadata' is a module parameter that enables/disables pruning
+ *	 the dentries and the inode of a file or directory on an affected
+ *	 device when it is closed for the last time. The inode is evicted
+ *	 only if it is clean, unused and not prewarmed, together with its
+ *	 clean pages, which are left alone otherwise.
+ *	 After every 'metadata_batch' closes on a file system, up to that
+ *	 many unused dentries and inodes per NUMA node are also pruned from
+ *	 it, and the clean buffer cache (e.g., inode tables and directory
+ *	 blocks) of its device is dropped. The default value is 'N'
+ *	 (disabled).
+ *
+ *	 # Measure a small-file benchmark without a warm metadata cache
+ *	 echo 1 > /sys/module/no_fscache/parameters/evict_metadata
+ *
+ * NOTE: 'scanner' is a module parameter that enables/disables a kernel thread
+ *	 that purges the page cache of the file systems on the affected
+ *	 devices every 'scan_interval_ms' milliseconds, at most
+ *	 'scan_pages_per_sec' pages per second, on the CPUs in 'scan_cpus'.
+ *	 The default value is 'N' (disabled). How much it had to purge is
+ *	 shown in /sys/kernel/debug/no_fscache/scanner.
+ *
+ *	 # Run the scanner on CPU 0-1
+ *	 echo 0-1 > /sys/module/no_fscache/parameters/scan_cpus
+ *	 echo 1 > /sys/module/no_fscache/parameters/scanner
+ *
+ * NOTE: Each device in 'no_fscache_device' can be followed by a write mode
+ *	 in the form of <device>:<mode>, which selects the durability level
+ *	 emulated for writes to that device. The default mode is 'start'.
+ *
+ *	 start	start write-back of the written range but do not wait for it
+ *		(SYNC_FILE_RANGE_WRITE with WB_SYNC_NONE).
+ *	 wait	write back the written range and wait for it to complete, so
+ *		the latency of each write includes the device time.
+ *	 sync	like 'wait' but also flush the device write cache, which
+ *		emulates a write-through device (fdatasync of the range).
+ *
+ *	 # Emulate a write-through sda and a write-back sdb
+ *	 echo 'sda:sync,sdb' > /sys/module/no_fscache/parameters/no_fscache_device
  */
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/backing-dev.h>
+#include <linux/blkdev.h>
+#include <linux/debugfs.h>
 #include <linux/fadvise.h>
 #include <linux/file.h>
 #include <linux/fsnotify.h>
+#include <linux/genhd.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
+#include <linux/jump_label.h>
+#include <linux/kthread.h>
+#include <linux/list_bl.h>
 #include <linux/livepatch.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/rcupdate.h>
+#include <linux/shrinker.h>
+#include <linux/sched/loadavg.h>
 #include <linux/sched/xacct.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/swap.h>
 #include <linux/uio.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
 #include <linux/writeback.h>
 
+#ifdef CONFIG_PSI
+#include <linux/psi_types.h>
+#endif
+
+#include "no_fscache_trace.h"
+
+/*
+ * Fallbacks for the helpers that are newer than the oldest kernel this
+ * module supports (OLDEST_SUPPORTED_KERNEL in the Makefile).
+ */
+#ifndef struct_size
+/* Added in v4.18. The callers here never come close to an overflow. */
+#define struct_size(p, member, n)                                              \
+	(sizeof(*(p)) + (size_t)(n) * sizeof(*(p)->member))
+#endif
+
+#ifndef SB_BORN
+/* The MS_* super block flags were renamed to SB_* in v4.14. */
+#define SB_BORN MS_BORN
+#endif
+
+#ifndef DEFINE_SHOW_ATTRIBUTE
+/* Added in v4.16. */
+#define DEFINE_SHOW_ATTRIBUTE(__name)                                          \
+static int __name ## _open(struct inode *inode, struct file *file)             \
+{                                                                              \
+	return single_open(file, __name ## _show, inode->i_private);           \
+}                                                                              \
+                                                                               \
+static const struct file_operations __name ## _fops = {                        \
+	.owner = THIS_MODULE,                                                  \
+	.open = __name ## _open,                                               \
+	.read = seq_read,                                                      \
+	.llseek = seq_lseek,                                                   \
+	.release = single_release,                                             \
+}
+#endif
+
+/*
+ * Set a bool parameter and flip the static key that mirrors it.
+ *
+ * @key: the static key to flip
+ * @enable_on: the value of the parameter that enables %key
+ */
+static int param_set_bool_key(const char *val, const struct kernel_param *kp,
+			      struct static_key *key, bool enable_on)
+{
+	bool *flag = kp->arg;
+	int ret;
+
+	ret = param_set_bool(val, kp);
+	if (ret)
+		return ret;
+
+	if (*flag == enable_on)
+		static_key_enable(key);
+	else
+		static_key_disable(key);
+
+	return 0;
+}
+
+static DEFINE_STATIC_KEY_FALSE(readahead_disabled);
+
+static int readahead_set(const char *val, const struct kernel_param *kp)
+{
+	return param_set_bool_key(val, kp, &readahead_disabled.key, false);
+}
+
 static bool readahead = true;
 static const struct kernel_param_ops readahead_param_ops = {
-	.set = param_set_bint,
+	.set = readahead_set,
 	.get = param_get_bool,
 };
 module_param_cb_unsafe(readahead, &readahead_param_ops, &readahead, 0644);
 MODULE_PARM_DESC(readahead,
 		 "Enable/Disable file readahead. Default: Y (enabled).");
 
+static DEFINE_STATIC_KEY_TRUE(evict_read_enabled);
+
+static int evict_read_set(const char *val, const struct kernel_param *kp)
+{
+	return param_set_bool_key(val, kp, &evict_read_enabled.key, true);
+}
+
+static bool evict_read = true;
+static const struct kernel_param_ops evict_read_param_ops = {
+	.set = evict_read_set,
+	.get = param_get_bool,
+};
+module_param_cb(evict_read, &evict_read_param_ops, &evict_read, 0644);
+MODULE_PARM_DESC(evict_read,
+		 "Enable/Disable cache elimination for reads. Default: Y.");
+
+static DEFINE_STATIC_KEY_TRUE(evict_write_enabled);
+
+static int evict_write_set(const char *val, const struct kernel_param *kp)
+{
+	return param_set_bool_key(val, kp, &evict_write_enabled.key, true);
+}
+
+static bool evict_write = true;
+static const struct kernel_param_ops evict_write_param_ops = {
+	.set = evict_write_set,
+	.get = param_get_bool,
+};
+module_param_cb(evict_write, &evict_write_param_ops, &evict_write, 0644);
+MODULE_PARM_DESC(evict_write,
+		 "Enable/Disable cache elimination for writes. Default: Y.");
+
 /*
  * module_param_array_ops_named - renamed parameter which is an array of some
  * type.
@@ -148,258 +407,2833 @@ static int param_array(struct module *mod, const char *name, const char *val,
 	return 0;
 }
 
-static int device_array_set(const char *val, const struct kernel_param *kp)
-{
-	const struct kparam_array *arr = kp->arr;
-	unsigned int temp_num;
+/*
+ * Miss ratio curve (MRC) estimation with SHARDS
+ * (https://www.usenix.org/conference/fast15/technical-sessions/presentation/waldspurger).
+ *
+ * Each page referenced by the hooks is hashed and only sampled if the hash is
+ * below a threshold, so that a small and bounded number of pages is tracked
+ * per device. The reuse distance of a sampled page is the number of distinct
+ * sampled pages referenced since the last reference to it, scaled by the
+ * sampling rate. When the number of samples exceeds 'mrc_max_samples', the
+ * threshold is lowered and the samples above it are dropped (fixed-size
+ * SHARDS).
+ */
+#define MRC_HASH_BITS 24
+#define MRC_MODULUS (1U << MRC_HASH_BITS)
+#define MRC_TABLE_BITS 12
+/* Reuse distances are counted in log2 buckets of pages. */
+#define MRC_NR_BUCKETS 48
+
+struct mrc_sample {
+	struct hlist_node hnode; /* in mrc_tracker->table */
+	struct rb_node time_rb; /* in mrc_tracker->time_root */
+	struct rb_node hash_rb; /* in mrc_tracker->hash_root */
+	dev_t dev; /* s_dev of the file system of the inode, or the device */
+	unsigned long ino; /* MRC_BDEV_INO for a block device */
+	pgoff_t index;
+	u32 hash;
+	u32 subtree; /* number of samples in the subtree of time_rb */
+	u64 time; /* logical time of the last reference */
+};
+
+struct mrc_tracker {
+	struct list_head list; /* in mrc_trackers */
+	dev_t devt;
+	u64 __percpu *refs; /* all the references, sampled or not */
+
+	spinlock_t lock; /* protects the fields below */
+	u32 threshold; /* sample a page if its hash is below this */
+	u32 nsamples;
+	u64 clock;
+	u64 cold; /* sampled references to pages never seen */
+	u64 histogram[MRC_NR_BUCKETS];
+	struct rb_root time_root; /* ordered by time, augmented with subtree */
+	struct rb_root hash_root; /* ordered by hash */
+	struct hlist_head table[1 << MRC_TABLE_BITS];
+};
+
+static LIST_HEAD(mrc_trackers);
+static DEFINE_MUTEX(mrc_mutex); /* protects mrc_trackers */
 
-	return param_array(kp->mod, kp->name, val, 1, arr->max, arr->elem,
-			   arr->elemsize, arr->ops->set, kp->level,
-			   arr->num ?: &temp_num);
+static DEFINE_STATIC_KEY_FALSE(mrc_enabled);
+
+static unsigned int mrc_max_samples = 8192;
+module_param(mrc_max_samples, uint, 0644);
+MODULE_PARM_DESC(mrc_max_samples,
+		 "Max number of pages tracked per device. Default: 8192.");
+
+static unsigned int mrc_sample_permyriad = 100;
+module_param(mrc_sample_permyriad, uint, 0644);
+MODULE_PARM_DESC(mrc_sample_permyriad,
+		 "Initial sampling rate in 1/10000. Default: 100 (1%).");
+
+static inline u32 mrc_subtree(struct rb_node *rb)
+{
+	return rb ? rb_entry(rb, struct mrc_sample, time_rb)->subtree : 0;
 }
 
-static int param_array_get(char *buffer, const struct kernel_param *kp)
+static inline u32 mrc_compute_subtree(struct mrc_sample *s)
 {
-	int i, off;
-	const struct kparam_array *arr = kp->arr;
-	struct kernel_param p = *kp;
+	return 1 + mrc_subtree(s->time_rb.rb_left) +
+	       mrc_subtree(s->time_rb.rb_right);
+}
 
-	for (i = off = 0; i < (arr->num ? *arr->num : arr->max); i++) {
-		int ret;
+static void mrc_propagate(struct rb_node *rb, struct rb_node *stop)
+{
+	while (rb != stop) {
+		struct mrc_sample *s = rb_entry(rb, struct mrc_sample, time_rb);
+		u32 subtree = mrc_compute_subtree(s);
 
-		/* Replace \n with comma */
-		if (i)
-			buffer[off - 1] = ',';
-		p.arg = arr->elem + arr->elemsize * i;
-		check_kparam_locked(p.mod);
-		ret = arr->ops->get(buffer + off, &p);
-		if (ret < 0)
-			return ret;
-		off += ret;
+		if (s->subtree == subtree)
+			break;
+		s->subtree = subtree;
+		rb = rb_parent(&s->time_rb);
 	}
-	buffer[off] = '\0';
-	return off;
 }
 
-static void param_array_free(void *arg)
+static void mrc_copy(struct rb_node *rb_old, struct rb_node *rb_new)
 {
-	const struct kparam_array *arr = arg;
+	rb_entry(rb_new, struct mrc_sample, time_rb)->subtree =
+		rb_entry(rb_old, struct mrc_sample, time_rb)->subtree;
+}
 
-	if (arr->ops->free) {
-		unsigned int i;
+static void mrc_rotate(struct rb_node *rb_old, struct rb_node *rb_new)
+{
+	struct mrc_sample *old = rb_entry(rb_old, struct mrc_sample, time_rb);
 
-		for (i = 0; i < (arr->num ? *arr->num : arr->max); i++)
-			arr->ops->free(arr->elem + arr->elemsize * i);
-	}
+	rb_entry(rb_new, struct mrc_sample, time_rb)->subtree = old->subtree;
+	old->subtree = mrc_compute_subtree(old);
 }
 
-#define MAX_BLKDEVS 128
-static char *no_fscache_device_param[MAX_BLKDEVS];
-static int ndevices;
-const struct kernel_param_ops device_array_ops = {
-	.set = device_array_set,
-	.get = param_array_get,
-	.free = param_array_free,
+static const struct rb_augment_callbacks mrc_callbacks = {
+	.propagate = mrc_propagate,
+	.copy = mrc_copy,
+	.rotate = mrc_rotate,
 };
 
-module_param_array_ops_named(no_fscache_device, no_fscache_device_param,
-			     &device_array_ops, charp, &ndevices, 0644);
+/* The sample must be the most recently referenced one. */
+static void mrc_time_insert(struct mrc_tracker *t, struct mrc_sample *s)
+{
+	struct rb_node **link = &t->time_root.rb_node, *parent = NULL;
 
-MODULE_PARM_DESC(no_fscache_device,
-		 "The affected block devices. Default: \"\" (none).");
+	while (*link) {
+		parent = *link;
+		rb_entry(parent, struct mrc_sample, time_rb)->subtree++;
+		link = &parent->rb_right;
+	}
 
-/*
- * These Functions are not exported to be used in loadable modules so we
- * look for them using kallsyms_lookup_name().
- */
-static asmlinkage long (*orig_sys_fadvise64_64)(int fd, loff_t offset,
-						loff_t len, int advice);
-static ssize_t (*orig_vfs_read)(struct file *file, char __user *buf,
-				size_t count, loff_t *pos);
-static ssize_t (*orig_vfs_write)(struct file *file, const char __user *buf,
-				 size_t count, loff_t *pos);
-static ssize_t (*orig_vfs_readv)(struct file *file,
-				 const struct iovec __user *vec,
-				 unsigned long vlen, loff_t *pos, rwf_t flags);
-static int (*rw_verify_area)(int read_write, struct file *file,
-			     const loff_t *ppos, size_t count);
-static long (*orig_do_sys_open)(int dfd, const char __user *filename, int flags,
-				umode_t mode);
-static int (*__orig_filemap_fdatawrite_range)(struct address_space *mapping,
-					      loff_t start, loff_t end,
-					      int sync_mode);
+	s->subtree = 1;
+	rb_link_node(&s->time_rb, parent, link);
+	rb_insert_augmented(&s->time_rb, &t->time_root, &mrc_callbacks);
+}
 
-static asmlinkage long no_fscache_sys_fadvise64_64(int fd, loff_t offset,
-						   loff_t len, int advice)
+/* Count the samples referenced after the sample. */
+static u32 mrc_count_newer(struct mrc_tracker *t, struct mrc_sample *s)
 {
-	if (!readahead)
-		switch (advice) {
-		case POSIX_FADV_NORMAL:
-		case POSIX_FADV_SEQUENTIAL:
-		case POSIX_FADV_WILLNEED:
-		case POSIX_FADV_NOREUSE:
-			/*
-			 * Implementation history of POSIX_FADV_RANDOM:
-			 * https://lore.kernel.org/patchwork/patch/187024/
-			 */
-			advice = POSIX_FADV_RANDOM;
+	struct rb_node *rb = t->time_root.rb_node;
+	u32 count = 0;
+
+	while (rb) {
+		struct mrc_sample *n = rb_entry(rb, struct mrc_sample, time_rb);
+
+		if (s->time < n->time) {
+			count += 1 + mrc_subtree(rb->rb_right);
+			rb = rb->rb_left;
+		} else {
+			rb = rb->rb_right;
 		}
+	}
 
-	return orig_sys_fadvise64_64(fd, offset, len, advice);
+	return count;
 }
 
-static long no_fscache_do_sys_open(int dfd, const char __user *filename,
-				   int flags, umode_t mode)
+static void mrc_hash_insert(struct mrc_tracker *t, struct mrc_sample *s)
 {
-	/*
-	 * We need O_DSYNC for the write operation as POSIX_FADV_DONTNEED uses
-	 * WB_SYNC_NONE to writeback dirty pages which does not wait for
-	 * existing IO to complete. See the following links for details:
-	 *	https://elixir.bootlin.com/linux/v5.3.6/source/include/linux/writeback.h#L42
-	 *	https://elixir.bootlin.com/linux/v5.3.6/source/mm/fadvise.c#L116
-	 */
-	int fd = orig_do_sys_open(dfd, filename, flags, mode);
+	struct rb_node **link = &t->hash_root.rb_node, *parent = NULL;
 
-	/*
-	 * If no advice is given for an open file, the default assumption is
-	 * POSIX_FADV_NORMAL, which sets the readahead window to the default
-	 * size for the backing device.
-	 * See https://linux.die.net/man/2/fadvise64_64
-	 */
-	if (!readahead) {
-		/*
-		 * Ignore return value because do_sys_open() shall return a
-		 * file descriptor even if it fails to advice the access
-		 * pattern.
-		 */
-		orig_sys_fadvise64_64(fd, 0, 0, POSIX_FADV_RANDOM);
+	while (*link) {
+		struct mrc_sample *n =
+			rb_entry(*link, struct mrc_sample, hash_rb);
+
+		parent = *link;
+		if (s->hash < n->hash)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
 	}
 
-	return fd;
+	rb_link_node(&s->hash_rb, parent, link);
+	rb_insert_color(&s->hash_rb, &t->hash_root);
 }
 
-static unsigned long __orig_fdget_pos(unsigned int fd)
+static void mrc_remove(struct mrc_tracker *t, struct mrc_sample *s)
 {
-	unsigned long v = __fdget(fd);
-	struct file *file = (struct file *)(v & ~3);
+	hash_del(&s->hnode);
+	rb_erase_augmented(&s->time_rb, &t->time_root, &mrc_callbacks);
+	rb_erase(&s->hash_rb, &t->hash_root);
+	t->nsamples--;
+	kfree(s);
+}
 
-	if (file && (file->f_mode & FMODE_ATOMIC_POS)) {
-		if (file_count(file) > 1) {
-			v |= FDPUT_POS_UNLOCK;
-			mutex_lock(&file->f_pos_lock);
-		}
+/* Lower the threshold until the number of samples is within the limit. */
+static void mrc_shrink(struct mrc_tracker *t)
+{
+	struct mrc_sample *s;
+
+	if (t->nsamples <= max(mrc_max_samples, 1U))
+		return;
+
+	s = rb_entry(rb_last(&t->hash_root), struct mrc_sample, hash_rb);
+	t->threshold = s->hash;
+	while (s && s->hash >= t->threshold) {
+		mrc_remove(t, s);
+		s = rb_entry_safe(rb_last(&t->hash_root), struct mrc_sample,
+				  hash_rb);
 	}
-	return v;
 }
 
-static inline struct fd orig_fdget_pos(int fd)
+static void mrc_reference(struct mrc_tracker *t, dev_t dev, unsigned long ino,
+			  pgoff_t index, u32 hash)
 {
-	return __to_fd(__orig_fdget_pos(fd));
+	struct mrc_sample *s;
+	u64 distance;
+
+	spin_lock(&t->lock);
+
+	if (hash >= t->threshold)
+		goto out;
+
+	hash_for_each_possible(t->table, s, hnode, hash) {
+		if (s->ino == ino && s->dev == dev && s->index == index)
+			break;
+	}
+
+	if (s) {
+		distance = (u64)mrc_count_newer(t, s) * MRC_MODULUS /
+			   t->threshold;
+		t->histogram[min(fls64(distance), MRC_NR_BUCKETS - 1)]++;
+		rb_erase_augmented(&s->time_rb, &t->time_root, &mrc_callbacks);
+	} else {
+		t->cold++;
+		s = kmalloc(sizeof(*s), GFP_ATOMIC | __GFP_NOWARN);
+		if (!s)
+			goto out;
+		s->dev = dev;
+		s->ino = ino;
+		s->index = index;
+		s->hash = hash;
+		hash_add(t->table, &s->hnode, hash);
+		mrc_hash_insert(t, s);
+		t->nsamples++;
+	}
+
+	s->time = ++t->clock;
+	mrc_time_insert(t, s);
+	mrc_shrink(t);
+
+out:
+	spin_unlock(&t->lock);
 }
 
 /*
- * File is stream-like
- * See https://elixir.bootlin.com/linux/v5.3.6/source/include/linux/fs.h#L162
+ * The inode number of the samples of a block device. All the block devices
+ * share the inodes of the bdev pseudo file system, so they are told apart by
+ * their device numbers instead.
  */
-#define FMODE_STREAM ((__force fmode_t)0x200000)
+#define MRC_BDEV_INO ULONG_MAX
 
-/* file_ppos returns &file->f_pos or NULL if file is stream */
-static inline loff_t *file_ppos(struct file *file)
+static void __mrc_access(struct mrc_tracker *t, struct file *file,
+			 loff_t offset, ssize_t count)
 {
-	return (file->f_mode & FMODE_STREAM) ? NULL : &file->f_pos;
+	struct inode *inode = file_inode(file);
+	/*
+	 * Inode numbers are only unique within a file system, and a tracker
+	 * covers all the partitions of a disk as well as the disk itself.
+	 */
+	dev_t dev = S_ISBLK(inode->i_mode) ? inode->i_rdev : inode->i_sb->s_dev;
+	unsigned long ino = S_ISBLK(inode->i_mode) ? MRC_BDEV_INO :
+						     inode->i_ino;
+	u64 key = (u64)ino ^ ((u64)dev << 32);
+	pgoff_t index = offset >> PAGE_SHIFT;
+	pgoff_t end = (offset + count - 1) >> PAGE_SHIFT;
+
+	this_cpu_add(*t->refs, end - index + 1);
+
+	for (; index <= end; index++) {
+		u32 hash = hash_64(key * GOLDEN_RATIO_64 + index,
+				   MRC_HASH_BITS);
+
+		/* Unsampled pages are filtered out without taking the lock. */
+		if (hash < READ_ONCE(t->threshold))
+			mrc_reference(t, dev, ino, index, hash);
+	}
 }
 
-static void __orig_f_unlock_pos(struct file *f)
+/*
+ * Feed the pages in the range [offset, offset + count) of the file to the MRC
+ * tracker of the device.
+ */
+static inline void mrc_access(struct mrc_tracker *t, struct file *file,
+			      loff_t offset, ssize_t count)
 {
-	mutex_unlock(&f->f_pos_lock);
+	if (static_branch_unlikely(&mrc_enabled))
+		__mrc_access(t, file, offset, count);
 }
 
-static inline void orig_fdput_pos(struct fd f)
+static void mrc_reset(struct mrc_tracker *t)
 {
-	if (f.flags & FDPUT_POS_UNLOCK)
-		__orig_f_unlock_pos(f.file);
-	fdput(f);
+	struct hlist_node *tmp;
+	struct mrc_sample *s;
+	int bkt;
+	int cpu;
+
+	spin_lock(&t->lock);
+	hash_for_each_safe(t->table, bkt, tmp, s, hnode)
+		mrc_remove(t, s);
+	t->threshold = (u64)MRC_MODULUS *
+		       clamp(mrc_sample_permyriad, 1U, 10000U) / 10000;
+	t->clock = 0;
+	t->cold = 0;
+	memset(t->histogram, 0, sizeof(t->histogram));
+	spin_unlock(&t->lock);
+
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(t->refs, cpu) = 0;
 }
 
-/*
- * Apply POSIX_FADV_DONTNEED advise to a region starting at spos (inclusive)
- * and ending at epos (exclusive) within the file referred to by fd.
- *
- * @fd: the file descriptor
- * @spos: start offset
- * @epos: end offset
- *
- * Return values have the same definition of fadvise64_64(2).
- */
-static inline int do_fadvise_dontneed(unsigned int fd, loff_t spos, loff_t epos)
+/* Get the MRC tracker of the device, or create one if it does not exist. */
+static struct mrc_tracker *mrc_get_tracker(dev_t devt)
 {
-	loff_t aligned_spos;
-	loff_t aligned_epos;
+	struct mrc_tracker *t;
 
-	if (!(epos - spos))
-		return 0;
+	mutex_lock(&mrc_mutex);
+	list_for_each_entry(t, &mrc_trackers, list) {
+		if (t->devt == devt)
+			goto out;
+	}
 
-	/*
-	 *  We round the spos down to a page boundary and round the epos up to
-	 *  a page boundary as partial pages are deliberately ignored by the
-	 *  fadvise64(2) call.
-	 *  See https://elixir.bootlin.com/linux/v5.3.6/source/mm/fadvise.c#L119
-	 *
-	 *  When the file offset, size of user buffer, or the value of count
-	 *  used in read(2), write(2), or similar system calls is not suitably
-	 *  aligned, the actual bytes to be flushed will be greater than the
-	 *  number of bytes returned by these calls. Therefore, we need to pay
-	 *  attention to the possible performance degradation caused by this
-	 *  overhead.
-	 */
+	t = kvzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		goto out;
+
+	t->refs = alloc_percpu(u64);
+	if (!t->refs) {
+		kvfree(t);
+		t = NULL;
+		goto out;
+	}
+
+	t->devt = devt;
+	spin_lock_init(&t->lock);
+	t->time_root = RB_ROOT;
+	t->hash_root = RB_ROOT;
+	hash_init(t->table);
+	mrc_reset(t);
+	list_add_tail(&t->list, &mrc_trackers);
+
+out:
+	mutex_unlock(&mrc_mutex);
+	return t;
+}
+
+static void mrc_free_trackers(void)
+{
+	struct mrc_tracker *t, *tmp;
+
+	list_for_each_entry_safe(t, tmp, &mrc_trackers, list) {
+		mrc_reset(t);
+		free_percpu(t->refs);
+		list_del(&t->list);
+		kvfree(t);
+	}
+}
+
+static int mrc_set(const char *val, const struct kernel_param *kp)
+{
+	struct mrc_tracker *t;
+	bool *enabled = kp->arg;
+	int ret;
+
+	ret = param_set_bool(val, kp);
+	if (ret)
+		return ret;
+
+	if (!*enabled) {
+		static_branch_disable(&mrc_enabled);
+		return 0;
+	}
+
+	/* Start a new curve every time the tracking is enabled. */
+	static_branch_disable(&mrc_enabled);
+	mutex_lock(&mrc_mutex);
+	list_for_each_entry(t, &mrc_trackers, list)
+		mrc_reset(t);
+	mutex_unlock(&mrc_mutex);
+	static_branch_enable(&mrc_enabled);
+
+	return 0;
+}
+
+static bool mrc;
+static const struct kernel_param_ops mrc_param_ops = {
+	.set = mrc_set,
+	.get = param_get_bool,
+};
+module_param_cb(mrc, &mrc_param_ops, &mrc, 0644);
+MODULE_PARM_DESC(mrc,
+		 "Enable/Disable miss ratio curve estimation. Default: N.");
+
+/*
+ * Show the estimated miss ratio of each device at cache sizes of power of 2
+ * pages, in the format of
+ *
+ *	device <major>:<minor> refs <n> sampled <n> samples <n> rate <r>
+ *	<cache size in pages> <miss ratio in percent>
+ *	...
+ */
+static int mrc_show(struct seq_file *m, void *v)
+{
+	u64 histogram[MRC_NR_BUCKETS];
+	struct mrc_tracker *t;
+	u64 refs, total, misses, cold;
+	u32 threshold, nsamples;
+	int i, cpu;
+
+	mutex_lock(&mrc_mutex);
+	list_for_each_entry(t, &mrc_trackers, list) {
+		refs = 0;
+		for_each_possible_cpu(cpu)
+			refs += *per_cpu_ptr(t->refs, cpu);
+
+		spin_lock(&t->lock);
+		memcpy(histogram, t->histogram, sizeof(histogram));
+		cold = t->cold;
+		threshold = t->threshold;
+		nsamples = t->nsamples;
+		spin_unlock(&t->lock);
+
+		total = cold;
+		for (i = 0; i < MRC_NR_BUCKETS; i++)
+			total += histogram[i];
+
+		seq_printf(m,
+			   "device %u:%u refs %llu sampled %llu samples %u rate %u/%u\n",
+			   MAJOR(t->devt), MINOR(t->devt), refs, total,
+			   nsamples, threshold, MRC_MODULUS);
+		if (!total)
+			continue;
+
+		/*
+		 * Bucket i holds the reuse distances in [2^(i-1), 2^i), which
+		 * hit in a cache of 2^i pages.
+		 */
+		misses = total - cold;
+		for (i = 0; i < MRC_NR_BUCKETS; i++) {
+			misses -= histogram[i];
+			seq_printf(m, "%llu %llu.%02llu\n", 1ULL << i,
+				   div64_u64((misses + cold) * 100, total),
+				   div64_u64((misses + cold) * 10000, total) %
+					   100);
+			if (!misses)
+				break;
+		}
+	}
+	mutex_unlock(&mrc_mutex);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mrc);
+
+/*
+ * I/O trace recorder. See no_fscache_trace.h for the layout of the per-CPU
+ * ring buffers.
+ */
+static DEFINE_STATIC_KEY_FALSE(iotrace_enabled);
+
+static unsigned int iotrace_records = 65536;
+module_param(iotrace_records, uint, 0444);
+MODULE_PARM_DESC(iotrace_records,
+		 "Records per per-CPU trace buffer. Default: 65536.");
+
+struct iotrace_buffer {
+	struct nofscache_trace_header *hdr;
+	struct nofscache_trace_record *records;
+	/* Not trusting the mapped header as userspace can modify it. */
+	u32 nr_records;
+};
+
+static DEFINE_PER_CPU(struct iotrace_buffer, iotrace_buffers);
+static DEFINE_MUTEX(iotrace_mutex); /* protects allocating the buffers */
+
+static void iotrace_free_buffers(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct iotrace_buffer *buf = per_cpu_ptr(&iotrace_buffers, cpu);
+
+		vfree(buf->hdr);
+		buf->hdr = NULL;
+	}
+}
+
+/*
+ * The buffers are allocated the first time tracing is enabled and only freed
+ * when the module is removed, so that consumers can keep them mapped.
+ */
+static int iotrace_alloc_buffers(void)
+{
+	u32 nr = roundup_pow_of_two(clamp(iotrace_records, 1U, 1U << 24));
+	struct iotrace_buffer *buf;
+	unsigned long size;
+	int cpu;
+
+	size = PAGE_SIZE + PAGE_ALIGN(nr * sizeof(*buf->records));
+
+	for_each_possible_cpu(cpu) {
+		buf = per_cpu_ptr(&iotrace_buffers, cpu);
+		if (buf->hdr)
+			continue;
+
+		buf->hdr = vmalloc_user(size);
+		if (!buf->hdr) {
+			iotrace_free_buffers();
+			return -ENOMEM;
+		}
+
+		buf->records = (void *)buf->hdr + PAGE_SIZE;
+		buf->nr_records = nr;
+		buf->hdr->magic = NOFSCACHE_TRACE_MAGIC;
+		buf->hdr->record_size = sizeof(*buf->records);
+		buf->hdr->nr_records = nr;
+		buf->hdr->data_offset = PAGE_SIZE;
+	}
+
+	return 0;
+}
+
+static int iotrace_set(const char *val, const struct kernel_param *kp)
+{
+	bool *enabled = kp->arg;
+	bool enable;
+	int ret;
+
+	ret = strtobool(val, &enable);
+	if (ret)
+		return ret;
+
+	if (enable) {
+		mutex_lock(&iotrace_mutex);
+		ret = iotrace_alloc_buffers();
+		mutex_unlock(&iotrace_mutex);
+		if (ret)
+			return ret;
+		static_branch_enable(&iotrace_enabled);
+	} else {
+		static_branch_disable(&iotrace_enabled);
+	}
+
+	*enabled = enable;
+	return 0;
+}
+
+static bool iotrace;
+static const struct kernel_param_ops iotrace_param_ops = {
+	.set = iotrace_set,
+	.get = param_get_bool,
+};
+module_param_cb(iotrace, &iotrace_param_ops, &iotrace, 0644);
+MODULE_PARM_DESC(iotrace, "Enable/Disable I/O tracing. Default: N.");
+
+/* Return the start time of an I/O to trace, or 0 if tracing is disabled. */
+static inline u64 iotrace_clock(void)
+{
+	if (static_branch_unlikely(&iotrace_enabled))
+		return ktime_get_ns();
+
+	return 0;
+}
+
+/* Return the device number of the file recorded in the I/O trace. */
+static inline dev_t file_devt(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+
+	return S_ISBLK(inode->i_mode) ? inode->i_rdev : inode->i_sb->s_dev;
+}
+
+static void __iotrace_record(u8 op, struct file *file, loff_t offset,
+			     ssize_t len, u64 start, unsigned long nrpages)
+{
+	unsigned long cur_nrpages = file->f_mapping->nrpages;
+	struct nofscache_trace_record *rec;
+	struct iotrace_buffer *buf;
+	u64 now = ktime_get_ns();
+	u64 head;
+
+	preempt_disable();
+	buf = this_cpu_ptr(&iotrace_buffers);
+	if (!buf->hdr)
+		goto out;
+
+	head = buf->hdr->head;
+	if (head - smp_load_acquire(&buf->hdr->tail) >= buf->nr_records) {
+		buf->hdr->dropped++;
+		goto out;
+	}
+
+	rec = &buf->records[head & (buf->nr_records - 1)];
+	rec->timestamp = start ?: now;
+	rec->ino = file->f_mapping->host->i_ino;
+	rec->offset = offset;
+	rec->dev = new_encode_dev(file_devt(file));
+	rec->pid = task_pid_nr(current);
+	rec->len = len;
+	rec->latency = start ? min_t(u64, now - start, U32_MAX) : 0;
+	rec->evicted = nrpages > cur_nrpages ? nrpages - cur_nrpages : 0;
+	rec->op = op;
+
+	/* Publish the record after it is written. */
+	smp_store_release(&buf->hdr->head, head + 1);
+
+out:
+	preempt_enable();
+}
+
+/*
+ * Record an I/O of the range [offset, offset + len) of the file.
+ *
+ * @start: the return value of iotrace_clock() at the start of the I/O
+ * @nrpages: the number of pages of the file mapping before the eviction
+ */
+static inline void iotrace_record(u8 op, struct file *file, loff_t offset,
+				  ssize_t len, u64 start,
+				  unsigned long nrpages)
+{
+	if (static_branch_unlikely(&iotrace_enabled))
+		__iotrace_record(op, file, offset, len, start, nrpages);
+}
+
+static int iotrace_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long cpu = (unsigned long)file->private_data;
+	struct iotrace_buffer *buf = per_cpu_ptr(&iotrace_buffers, cpu);
+
+	if (!buf->hdr)
+		return -ENODEV;
+
+	return remap_vmalloc_range(vma, buf->hdr, vma->vm_pgoff);
+}
+
+static const struct file_operations iotrace_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.mmap = iotrace_mmap,
+	.llseek = noop_llseek,
+};
+
+static void iotrace_create_files(struct dentry *parent)
+{
+	struct dentry *dir = debugfs_create_dir("trace", parent);
+	unsigned long cpu;
+	char name[16];
+
+	for_each_possible_cpu(cpu) {
+		snprintf(name, sizeof(name), "cpu%lu", cpu);
+		debugfs_create_file(name, 0600, dir, (void *)cpu,
+				    &iotrace_fops);
+	}
+}
+
+/*
+ * Submission queues of the deferred evictions and write-backs, one for each
+ * affected device. Every queue has a list of works per NUMA node. See the
+ * deferred section below for how they are drained.
+ */
+struct evict_queue {
+	struct list_head list; /* in evict_queues */
+	dev_t devt;
+	spinlock_t lock;
+	unsigned int depth; /* number of works in all the lists */
+	unsigned long queued;
+	unsigned long stolen; /* works run by a worker of another node */
+	unsigned long throttled; /* works whose producer waited for room */
+	wait_queue_head_t wait; /* producers waiting for room */
+	struct list_head works[]; /* indexed by node */
+};
+
+static LIST_HEAD(evict_queues);
+static DEFINE_MUTEX(evict_queues_mutex);
+
+static struct evict_queue *evict_get_queue(dev_t devt)
+{
+	struct evict_queue *q;
+	int nid;
+
+	mutex_lock(&evict_queues_mutex);
+	list_for_each_entry(q, &evict_queues, list) {
+		if (q->devt == devt)
+			goto out;
+	}
+
+	q = kzalloc(struct_size(q, works, nr_node_ids), GFP_KERNEL);
+	if (!q)
+		goto out;
+
+	q->devt = devt;
+	spin_lock_init(&q->lock);
+	init_waitqueue_head(&q->wait);
+	for (nid = 0; nid < nr_node_ids; nid++)
+		INIT_LIST_HEAD(&q->works[nid]);
+	/* The workers walk the queues without taking the mutex. */
+	list_add_tail_rcu(&q->list, &evict_queues);
+
+out:
+	mutex_unlock(&evict_queues_mutex);
+	return q;
+}
+
+static void evict_free_queues(void)
+{
+	struct evict_queue *q, *tmp;
+
+	list_for_each_entry_safe(q, tmp, &evict_queues, list) {
+		list_del(&q->list);
+		kfree(q);
+	}
+}
+
+/*
+ * Write modes emulating different durability levels of a storage device.
+ * See the NOTE at the top of this file.
+ */
+enum write_mode {
+	WRITE_MODE_START,
+	WRITE_MODE_WAIT,
+	WRITE_MODE_SYNC,
+};
+
+static const char *const write_mode_names[] = {
+	[WRITE_MODE_START] = "start",
+	[WRITE_MODE_WAIT] = "wait",
+	[WRITE_MODE_SYNC] = "sync",
+};
+
+struct fscache_device {
+	dev_t devt; /* devt of the whole disk */
+	enum write_mode write_mode;
+	struct mrc_tracker *mrc;
+	struct evict_queue *queue;
+};
+
+/*
+ * The resolved form of the 'no_fscache_device' parameter. The system call
+ * hooks look up devices in this table under rcu_read_lock() so that updating
+ * the parameter does not need to synchronize with in-flight I/Os.
+ */
+struct fscache_device_table {
+	struct rcu_head rcu;
+	int ndevices;
+	struct fscache_device devices[];
+};
+
+static struct fscache_device_table __rcu *device_table;
+
+/* Enabled when there is at least one device in device_table. */
+static DEFINE_STATIC_KEY_FALSE(devices_enabled);
+
+/*
+ * Parse one element of the 'no_fscache_device' parameter in the form of
+ * <device>[:<mode>].
+ *
+ * Return 0 on success, 1 if the element is blank, -ENODEV if the device does
+ * not exist, or -EINVAL if the mode is unknown.
+ */
+static int parse_device(const char *param, struct fscache_device *dev)
+{
+	char *name, *mode;
+	int ret = 0;
+
+	name = kstrdup(param, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	dev->write_mode = WRITE_MODE_START;
+	mode = strchr(name, ':');
+	if (mode) {
+		*mode++ = '\0';
+		ret = match_string(write_mode_names,
+				   ARRAY_SIZE(write_mode_names), strim(mode));
+		if (ret < 0) {
+			pr_err("unknown write mode '%s' of device %s\n",
+			       strim(mode), strim(name));
+			goto out;
+		}
+		dev->write_mode = ret;
+		ret = 0;
+	}
+
+	if (!*strim(name)) {
+		ret = 1;
+		goto out;
+	}
+
+	dev->devt = blk_lookup_devt(strim(name), 0);
+	if (!dev->devt) {
+		pr_err("unknown device: %s\n", strim(name));
+		ret = -ENODEV;
+		goto out;
+	}
+
+	dev->mrc = mrc_get_tracker(dev->devt);
+	dev->queue = evict_get_queue(dev->devt);
+	if (!dev->mrc || !dev->queue)
+		ret = -ENOMEM;
+
+out:
+	kfree(name);
+	return ret;
+}
+
+static int update_device_table(char **params, int num)
+{
+	struct fscache_device_table *table, *old_table;
+	int i, ret;
+
+	table = kzalloc(struct_size(table, devices, num), GFP_KERNEL);
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i < num; i++) {
+		ret = parse_device(params[i],
+				   &table->devices[table->ndevices]);
+		if (ret < 0) {
+			kfree(table);
+			return ret;
+		}
+		if (!ret)
+			table->ndevices++;
+	}
+
+	/* Writers are serialized by the module's param_lock. */
+	old_table = rcu_dereference_protected(device_table, 1);
+	rcu_assign_pointer(device_table, table);
+	if (old_table)
+		kfree_rcu(old_table, rcu);
+
+	if (table->ndevices)
+		static_branch_enable(&devices_enabled);
+	else
+		static_branch_disable(&devices_enabled);
+
+	return 0;
+}
+
+static void param_array_free_elems(const struct kparam_array *arr,
+				   void *elem, unsigned int num)
+{
+	unsigned int i;
+
+	if (arr->ops->free)
+		for (i = 0; i < num; i++)
+			arr->ops->free(elem + arr->elemsize * i);
+}
+
+static int device_array_set(const char *val, const struct kernel_param *kp)
+{
+	const struct kparam_array *arr = kp->arr;
+	unsigned int temp_num;
+	unsigned int *num = arr->num ?: &temp_num;
+	unsigned int new_num = 0;
+	void *elem;
+	int ret;
+
+	/*
+	 * Parse the list into a scratch array, and replace the shown list
+	 * only if all the devices in it are valid.
+	 */
+	elem = kcalloc(arr->max, arr->elemsize, GFP_KERNEL);
+	if (!elem)
+		return -ENOMEM;
+
+	/* An empty list is allowed so that no device is affected. */
+	ret = param_array(kp->mod, kp->name, val, 0, arr->max, elem,
+			  arr->elemsize, arr->ops->set, kp->level, &new_num);
+	if (!ret)
+		ret = update_device_table(elem, new_num);
+
+	if (ret) {
+		/* Unused elements are NULL, which the free ops ignore. */
+		param_array_free_elems(arr, elem, arr->max);
+	} else {
+		param_array_free_elems(arr, arr->elem, *num);
+		memcpy(arr->elem, elem, arr->elemsize * arr->max);
+		*num = new_num;
+	}
+
+	kfree(elem);
+	return ret;
+}
+
+static int param_array_get(char *buffer, const struct kernel_param *kp)
+{
+	int i, off;
+	const struct kparam_array *arr = kp->arr;
+	struct kernel_param p = *kp;
+
+	for (i = off = 0; i < (arr->num ? *arr->num : arr->max); i++) {
+		int ret;
+
+		/* Replace \n with comma */
+		if (i)
+			buffer[off - 1] = ',';
+		p.arg = arr->elem + arr->elemsize * i;
+		check_kparam_locked(p.mod);
+		ret = arr->ops->get(buffer + off, &p);
+		if (ret < 0)
+			return ret;
+		off += ret;
+	}
+	buffer[off] = '\0';
+	return off;
+}
+
+static void param_array_free(void *arg)
+{
+	const struct kparam_array *arr = arg;
+
+	param_array_free_elems(arr, arr->elem,
+			       arr->num ? *arr->num : arr->max);
+}
+
+#define MAX_BLKDEVS 128
+static char *no_fscache_device_param[MAX_BLKDEVS];
+static int ndevices;
+const struct kernel_param_ops device_array_ops = {
+	.set = device_array_set,
+	.get = param_array_get,
+	.free = param_array_free,
+};
+
+module_param_array_ops_named(no_fscache_device, no_fscache_device_param,
+			     &device_array_ops, charp, &ndevices, 0644);
+
+MODULE_PARM_DESC(no_fscache_device,
+		 "The affected block devices. Default: \"\" (none).");
+
+/*
+ * These Functions are not exported to be used in loadable modules so we
+ * look for them using kallsyms_lookup_name().
+ */
+static asmlinkage long (*orig_sys_fadvise64_64)(int fd, loff_t offset,
+						loff_t len, int advice);
+static ssize_t (*orig_vfs_read)(struct file *file, char __user *buf,
+				size_t count, loff_t *pos);
+static ssize_t (*orig_vfs_write)(struct file *file, const char __user *buf,
+				 size_t count, loff_t *pos);
+static ssize_t (*orig_vfs_readv)(struct file *file,
+				 const struct iovec __user *vec,
+				 unsigned long vlen, loff_t *pos, rwf_t flags);
+static int (*rw_verify_area)(int read_write, struct file *file,
+			     const loff_t *ppos, size_t count);
+static long (*orig_do_sys_open)(int dfd, const char __user *filename, int flags,
+				umode_t mode);
+static int (*__orig_filemap_fdatawrite_range)(struct address_space *mapping,
+					      loff_t start, loff_t end,
+					      int sync_mode);
+static int (*orig_force_page_cache_readahead)(struct address_space *mapping,
+					      struct file *filp, pgoff_t offset,
+					      unsigned long nr_to_read);
+static void (*orig_locks_remove_file)(struct file *filp);
+static void (*orig_iterate_supers)(void (*f)(struct super_block *, void *),
+				   void *arg);
+static long (*orig_prune_dcache_sb)(struct super_block *sb,
+				    struct shrink_control *sc);
+static long (*orig_prune_icache_sb)(struct super_block *sb,
+				    struct shrink_control *sc);
+#ifdef CONFIG_PSI
+static struct psi_group *orig_psi_system;
+#endif
+
+static asmlinkage long no_fscache_sys_fadvise64_64(int fd, loff_t offset,
+						   loff_t len, int advice)
+{
+	if (static_branch_unlikely(&readahead_disabled))
+		switch (advice) {
+		case POSIX_FADV_NORMAL:
+		case POSIX_FADV_SEQUENTIAL:
+		case POSIX_FADV_WILLNEED:
+		case POSIX_FADV_NOREUSE:
+			/*
+			 * Implementation history of POSIX_FADV_RANDOM:
+			 * https://lore.kernel.org/patchwork/patch/187024/
+			 */
+			advice = POSIX_FADV_RANDOM;
+		}
+
+	return orig_sys_fadvise64_64(fd, offset, len, advice);
+}
+
+static long no_fscache_do_sys_open(int dfd, const char __user *filename,
+				   int flags, umode_t mode)
+{
+	/*
+	 * We need O_DSYNC for the write operation as POSIX_FADV_DONTNEED uses
+	 * WB_SYNC_NONE to writeback dirty pages which does not wait for
+	 * existing IO to complete. See the following links for details:
+	 *	https://elixir.bootlin.com/linux/v5.3.6/source/include/linux/writeback.h#L42
+	 *	https://elixir.bootlin.com/linux/v5.3.6/source/mm/fadvise.c#L116
+	 */
+	int fd = orig_do_sys_open(dfd, filename, flags, mode);
+
+	/*
+	 * If no advice is given for an open file, the default assumption is
+	 * POSIX_FADV_NORMAL, which sets the readahead window to the default
+	 * size for the backing device.
+	 * See https://linux.die.net/man/2/fadvise64_64
+	 */
+	if (static_branch_unlikely(&readahead_disabled)) {
+		/*
+		 * Ignore return value because do_sys_open() shall return a
+		 * file descriptor even if it fails to advice the access
+		 * pattern.
+		 */
+		orig_sys_fadvise64_64(fd, 0, 0, POSIX_FADV_RANDOM);
+	}
+
+	return fd;
+}
+
+static unsigned long __orig_fdget_pos(unsigned int fd)
+{
+	unsigned long v = __fdget(fd);
+	struct file *file = (struct file *)(v & ~3);
+
+	if (file && (file->f_mode & FMODE_ATOMIC_POS)) {
+		if (file_count(file) > 1) {
+			v |= FDPUT_POS_UNLOCK;
+			mutex_lock(&file->f_pos_lock);
+		}
+	}
+	return v;
+}
+
+static inline struct fd orig_fdget_pos(int fd)
+{
+	return __to_fd(__orig_fdget_pos(fd));
+}
+
+/*
+ * File is stream-like
+ * See https://elixir.bootlin.com/linux/v5.3.6/source/include/linux/fs.h#L162
+ */
+#define FMODE_STREAM ((__force fmode_t)0x200000)
+
+/* file_ppos returns &file->f_pos or NULL if file is stream */
+static inline loff_t *file_ppos(struct file *file)
+{
+	return (file->f_mode & FMODE_STREAM) ? NULL : &file->f_pos;
+}
+
+static void __orig_f_unlock_pos(struct file *f)
+{
+	mutex_unlock(&f->f_pos_lock);
+}
+
+/*
+ * Release f_pos_lock before the reference to the file is dropped. This is used
+ * to start write-back or eviction of the range just read or written outside of
+ * the critical section, so that threads sharing the same struct file are not
+ * serialized behind each other's write-back submission.
+ */
+static inline void orig_f_unlock_pos(struct fd *f)
+{
+	if (f->flags & FDPUT_POS_UNLOCK) {
+		__orig_f_unlock_pos(f->file);
+		f->flags &= ~FDPUT_POS_UNLOCK;
+	}
+}
+
+static inline void orig_fdput_pos(struct fd f)
+{
+	if (f.flags & FDPUT_POS_UNLOCK)
+		__orig_f_unlock_pos(f.file);
+	fdput(f);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 19, 0)
+/*
+ * vfs_fadvise() was added in v4.19. Before that, the advice was applied only
+ * by the system call, so this is its POSIX_FADV_DONTNEED case, the only one
+ * used here, working on the file instead of a descriptor.
+ * See https://elixir.bootlin.com/linux/v4.18/source/mm/fadvise.c#L115
+ */
+static int vfs_fadvise(struct file *file, loff_t offset, loff_t len,
+		       int advice)
+{
+	struct address_space *mapping = file->f_mapping;
+	loff_t endbyte = offset + len - 1; /* inclusive, len is never 0 */
+	pgoff_t start_index, end_index;
+	unsigned long count;
+
+	if (WARN_ON_ONCE(advice != POSIX_FADV_DONTNEED))
+		return -EINVAL;
+
+	if (!inode_write_congested(mapping->host))
+		__orig_filemap_fdatawrite_range(mapping, offset, endbyte,
+						WB_SYNC_NONE);
+
+	/* Partial pages at both ends are not evicted. */
+	start_index = (offset + (PAGE_SIZE - 1)) >> PAGE_SHIFT;
+	end_index = endbyte >> PAGE_SHIFT;
+	if ((endbyte & ~PAGE_MASK) != ~PAGE_MASK) {
+		if (end_index == 0)
+			return 0;
+		end_index--;
+	}
+
+	if (end_index < start_index)
+		return 0;
+
+	lru_add_drain();
+	count = invalidate_mapping_pages(mapping, start_index, end_index);
+	/* Some pages may be in the LRU pagevecs of the other CPUs. */
+	if (count < end_index - start_index + 1) {
+		lru_add_drain_all();
+		invalidate_mapping_pages(mapping, start_index, end_index);
+	}
+
+	return 0;
+}
+#endif
+
+/*
+ * Apply POSIX_FADV_DONTNEED advise to a region starting at spos (inclusive)
+ * and ending at epos (exclusive) within the file. The file is used instead of
+ * its descriptor so that the advice can also be applied by the workers that
+ * the eviction is deferred to.
+ *
+ * @file: the file
+ * @spos: start offset
+ * @epos: end offset
+ *
+ * Return values have the same definition of fadvise64_64(2).
+ */
+static inline int do_fadvise_dontneed(struct file *file, loff_t spos,
+				      loff_t epos)
+{
+	loff_t aligned_spos;
+	loff_t aligned_epos;
+
+	if (!(epos - spos))
+		return 0;
+
+	/*
+	 *  We round the spos down to a page boundary and round the epos up to
+	 *  a page boundary as partial pages are deliberately ignored by the
+	 *  fadvise64(2) call.
+	 *  See https://elixir.bootlin.com/linux/v5.3.6/source/mm/fadvise.c#L119
+	 *
+	 *  When the file offset, size of user buffer, or the value of count
+	 *  used in read(2), write(2), or similar system calls is not suitably
+	 *  aligned, the actual bytes to be flushed will be greater than the
+	 *  number of bytes returned by these calls. Therefore, we need to pay
+	 *  attention to the possible performance degradation caused by this
+	 *  overhead.
+	 */
 
 	aligned_spos = spos & PAGE_MASK;
 	aligned_epos = (epos + ~PAGE_MASK) & PAGE_MASK;
 
-	return orig_sys_fadvise64_64(fd, aligned_spos,
-				     aligned_epos - aligned_spos,
-				     POSIX_FADV_DONTNEED);
+	return vfs_fadvise(file, aligned_spos, aligned_epos - aligned_spos,
+			   POSIX_FADV_DONTNEED);
+}
+
+/*
+ * Get the range [*first, *last) of the page indexes covered by the page
+ * cached at @index of @mapping. It is a single page unless the page is part
+ * of a transparent huge page, which is never split for eviction. Before
+ * v5.4, only shmem has transparent huge pages in the page cache, and it is
+ * never hooked, so the page is not even looked up.
+ */
+static void cached_page_span(struct address_space *mapping, pgoff_t index,
+			     pgoff_t *first, pgoff_t *last)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+	struct page *page, *head;
+#endif
+
+	*first = index;
+	*last = index + 1;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+	/* Only count the read-only THPs of CONFIG_READ_ONLY_THP_FOR_FS. */
+	if (!filemap_nr_thps(mapping))
+		return;
+
+	page = find_get_page(mapping, index);
+	if (!page)
+		return;
+
+	head = compound_head(page);
+	if (PageTransHuge(head)) {
+		*first = head->index;
+		*last = head->index + hpage_nr_pages(head);
+	}
+	put_page(page);
+#endif
+}
+
+/*
+ * This function is enhanced based on
+ * io_is_direct() from
+ *	https://elixir.bootlin.com/linux/v5.3.6/source/include/linux/fs.h#L3304
+ * xfs_file_read_iter() from
+ *	https://elixir.bootlin.com/linux/v5.3.6/source/fs/xfs/xfs_file.c#L261
+ * and xfs_file_write_iter() from
+ *	https://elixir.bootlin.com/linux/v5.3.6/source/fs/xfs/xfs_file.c#L706
+ */
+static inline bool is_direct(struct file *filp)
+{
+	return (filp->f_flags & O_DIRECT) || IS_DAX(filp->f_mapping->host) ||
+	       IS_DAX(file_inode(filp));
+}
+
+/*
+ * Look up the affected device of the block device.
+ *
+ * @bdev: the block device or one of its partitions, can be NULL
+ * @dev: filled with a copy of the device entry if found
+ *
+ * Return true if the block device is one of the devices specified by the
+ * 'no_fscache_device' parameter.
+ */
+static bool lookup_bdev_device(struct block_device *bdev,
+			       struct fscache_device *dev)
+{
+	struct fscache_device_table *table;
+	bool found = false;
+	dev_t devt;
+	int i;
+
+	if (!static_branch_unlikely(&devices_enabled) || !bdev)
+		return false;
+	devt = disk_devt(bdev->bd_disk);
+
+	rcu_read_lock();
+	table = rcu_dereference(device_table);
+	for (i = 0; table && i < table->ndevices; i++) {
+		if (table->devices[i].devt == devt) {
+			*dev = table->devices[i];
+			found = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return found;
+}
+
+/*
+ * Return true if the file is cached in the page cache of its own, i.e., it is
+ * a regular file or a block device accessed directly.
+ */
+static inline bool is_cached_file(umode_t i_mode)
+{
+	return S_ISREG(i_mode) || S_ISBLK(i_mode);
+}
+
+/* Return the block device that stores the file, or NULL if there is none. */
+static inline struct block_device *file_bdev(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+
+	/* The page cache of a block device is in the mapping of its inode. */
+	if (S_ISBLK(inode->i_mode))
+		return I_BDEV(file->f_mapping->host);
+
+	return inode->i_sb->s_bdev;
+}
+
+/*
+ * Look up the affected device that stores the file.
+ *
+ * @file: the struct file pointer of a regular file or a block device
+ * @dev: filled with a copy of the device entry if found
+ *
+ * Return true if the file is stored on, or is, one of the devices specified
+ * by the 'no_fscache_device' parameter.
+ */
+static inline bool lookup_device(struct file *file, struct fscache_device *dev)
+{
+	return lookup_bdev_device(file_bdev(file), dev);
+}
+
+/*
+ * Cache prewarming. A manifest of file ranges written to
+ * /sys/kernel/debug/no_fscache/prewarm is read into the page cache in
+ * parallel, and the ranges are pinned so that the hooks do not evict them.
+ */
+enum prewarm_status {
+	PREWARM_PARTIAL = 2, /* some pages of the range are not cached */
+	PREWARM_PENDING = 1,
+	PREWARM_DONE = 0,
+	/* Negative values are errors. */
+};
+
+struct prewarm_range {
+	struct list_head list; /* in prewarm_ranges */
+	struct list_head pin; /* in prewarm_inode->pins, sorted by start */
+	struct work_struct work;
+	struct file *file;
+	char *path;
+	loff_t start, end; /* page aligned, end is exclusive */
+	unsigned long cached; /* pages cached after prewarming */
+	int status;
+};
+
+struct prewarm_inode {
+	struct hlist_node hnode; /* in prewarm_inodes */
+	struct inode *inode;
+	struct list_head pins;
+};
+
+static DEFINE_STATIC_KEY_FALSE(prewarm_pinned);
+
+static LIST_HEAD(prewarm_ranges);
+static DEFINE_MUTEX(prewarm_mutex); /* protects prewarm_ranges */
+
+static DEFINE_HASHTABLE(prewarm_inodes, 8);
+static DEFINE_RWLOCK(prewarm_lock); /* protects prewarm_inodes */
+
+static struct workqueue_struct *prewarm_wq;
+
+static struct prewarm_inode *prewarm_find_inode(struct inode *inode)
+{
+	struct prewarm_inode *pi;
+
+	hash_for_each_possible(prewarm_inodes, pi, hnode, (unsigned long)inode)
+		if (pi->inode == inode)
+			return pi;
+
+	return NULL;
+}
+
+/*
+ * Find the first pinned range of the inode overlapping [spos, epos).
+ *
+ * Return true and fill in the pinned range if found.
+ */
+static bool prewarm_find_pinned(struct inode *inode, loff_t spos,
+				loff_t epos, loff_t *pin_spos, loff_t *pin_epos)
+{
+	struct prewarm_inode *pi;
+	struct prewarm_range *r;
+	bool found = false;
+
+	read_lock(&prewarm_lock);
+	pi = prewarm_find_inode(inode);
+	if (!pi)
+		goto out;
+
+	list_for_each_entry(r, &pi->pins, pin) {
+		if (r->end <= spos)
+			continue;
+		if (r->start < epos) {
+			*pin_spos = r->start;
+			*pin_epos = r->end;
+			found = true;
+		}
+		break;
+	}
+
+out:
+	read_unlock(&prewarm_lock);
+	return found;
+}
+
+static int prewarm_pin(struct prewarm_range *range)
+{
+	struct inode *inode = range->file->f_mapping->host;
+	struct prewarm_inode *pi, *new_pi;
+	struct prewarm_range *r;
+
+	new_pi = kmalloc(sizeof(*new_pi), GFP_KERNEL);
+	if (!new_pi)
+		return -ENOMEM;
+
+	write_lock(&prewarm_lock);
+	pi = prewarm_find_inode(inode);
+	if (!pi) {
+		pi = new_pi;
+		new_pi = NULL;
+		pi->inode = inode;
+		INIT_LIST_HEAD(&pi->pins);
+		hash_add(prewarm_inodes, &pi->hnode, (unsigned long)inode);
+	}
+
+	list_for_each_entry(r, &pi->pins, pin)
+		if (r->start > range->start)
+			break;
+	list_add_tail(&range->pin, &r->pin);
+	write_unlock(&prewarm_lock);
+
+	kfree(new_pi);
+	return 0;
+}
+
+static void prewarm_unpin(struct prewarm_range *range)
+{
+	struct prewarm_inode *pi;
+
+	write_lock(&prewarm_lock);
+	list_del(&range->pin);
+	pi = prewarm_find_inode(range->file->f_mapping->host);
+	if (list_empty(&pi->pins))
+		hash_del(&pi->hnode);
+	else
+		pi = NULL;
+	write_unlock(&prewarm_lock);
+
+	kfree(pi);
+}
+
+static void prewarm_work(struct work_struct *work)
+{
+	struct prewarm_range *range =
+		container_of(work, struct prewarm_range, work);
+	struct address_space *mapping = range->file->f_mapping;
+	loff_t isize = i_size_read(mapping->host);
+	pgoff_t index = range->start >> PAGE_SHIFT;
+	pgoff_t end = range->end >> PAGE_SHIFT;
+	unsigned long cached = 0, window, nr;
+	pgoff_t next;
+	int ret;
+
+	/* Pages past the end of file can never be cached. */
+	end = min_t(pgoff_t, end, (isize + ~PAGE_MASK) >> PAGE_SHIFT);
+	end = max(end, index);
+
+	/*
+	 * force_page_cache_readahead() reads at most one readahead window
+	 * at a time, so read the range window by window.
+	 * See https://elixir.bootlin.com/linux/v5.3.6/source/mm/readahead.c#L213
+	 */
+	window = max_t(unsigned long,
+		       inode_to_bdi(mapping->host)->io_pages,
+		       range->file->f_ra.ra_pages);
+	window = max(window, 1UL);
+
+	for (next = index; next < end; next += nr) {
+		nr = min_t(unsigned long, window, end - next);
+		ret = orig_force_page_cache_readahead(mapping, range->file,
+						      next, nr);
+		if (ret < 0)
+			goto out;
+		cond_resched();
+	}
+
+	/* Wait for the reads to complete. */
+	for (; index < end; index++) {
+		struct page *page = find_get_page(mapping, index);
+
+		if (!page)
+			continue;
+		wait_on_page_locked(page);
+		if (PageUptodate(page))
+			cached++;
+		put_page(page);
+		cond_resched();
+	}
+
+	range->cached = cached;
+	ret = cached < end - (range->start >> PAGE_SHIFT) ?
+	      PREWARM_PARTIAL : PREWARM_DONE;
+
+out:
+	WRITE_ONCE(range->status, ret);
+}
+
+static void prewarm_free(struct prewarm_range *range)
+{
+	fput(range->file);
+	kfree(range->path);
+	kfree(range);
+}
+
+/*
+ * Add a range of the manifest in the form of "<path> <offset> <length>".
+ * A length of 0 means to the end of the file.
+ */
+static int prewarm_add(char *line)
+{
+	struct prewarm_range *range;
+	char *path, *token;
+	loff_t offset, len;
+	int ret;
+
+	path = strsep(&line, " \t");
+	token = strsep(&line, " \t");
+	if (!path || !*path || !token || kstrtoll(token, 0, &offset) ||
+	    !line || kstrtoll(strim(line), 0, &len) || offset < 0 || len < 0)
+		return -EINVAL;
+
+	range = kzalloc(sizeof(*range), GFP_KERNEL);
+	if (!range)
+		return -ENOMEM;
+
+	range->path = kstrdup(path, GFP_KERNEL);
+	if (!range->path) {
+		kfree(range);
+		return -ENOMEM;
+	}
+
+	range->file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(range->file)) {
+		ret = PTR_ERR(range->file);
+		pr_err("failed to open %s for prewarming: %d\n", path, ret);
+		kfree(range->path);
+		kfree(range);
+		return ret;
+	}
+
+	if (!len)
+		len = i_size_read(range->file->f_mapping->host) - offset;
+	range->start = offset & PAGE_MASK;
+	range->end = max(range->start, (offset + len + ~PAGE_MASK) & PAGE_MASK);
+	range->status = PREWARM_PENDING;
+	INIT_WORK(&range->work, prewarm_work);
+
+	ret = prewarm_pin(range);
+	if (ret) {
+		prewarm_free(range);
+		return ret;
+	}
+
+	list_add_tail(&range->list, &prewarm_ranges);
+	static_branch_enable(&prewarm_pinned);
+	queue_work(prewarm_wq, &range->work);
+
+	return 0;
+}
+
+static void prewarm_clear(void)
+{
+	struct prewarm_range *range, *tmp;
+
+	static_branch_disable(&prewarm_pinned);
+	flush_workqueue(prewarm_wq);
+
+	list_for_each_entry_safe(range, tmp, &prewarm_ranges, list) {
+		list_del(&range->list);
+		prewarm_unpin(range);
+		prewarm_free(range);
+	}
+}
+
+/*
+ * Each line written is either a range of the manifest to prewarm and pin, or
+ * "clear" to unpin all the ranges.
+ */
+static ssize_t prewarm_write(struct file *file, const char __user *ubuf,
+			     size_t count, loff_t *ppos)
+{
+	char *buf, *cur, *line;
+	int ret = 0;
+
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	mutex_lock(&prewarm_mutex);
+	cur = buf;
+	while ((line = strsep(&cur, "\n")) && !ret) {
+		line = strim(line);
+		if (!*line || *line == '#')
+			continue;
+
+		if (!strcmp(line, "clear"))
+			prewarm_clear();
+		else
+			ret = prewarm_add(line);
+	}
+	mutex_unlock(&prewarm_mutex);
+
+	kfree(buf);
+	return ret ?: count;
+}
+
+/*
+ * Show the status of each range in the form of
+ *	<path> <offset> <length> <pending|done|error code> <cached pages>
+ * followed by a summary line.
+ */
+static int prewarm_show(struct seq_file *m, void *v)
+{
+	unsigned int pending = 0, done = 0, partial = 0, failed = 0;
+	struct prewarm_range *range;
+
+	mutex_lock(&prewarm_mutex);
+	list_for_each_entry(range, &prewarm_ranges, list) {
+		int status = READ_ONCE(range->status);
+
+		seq_printf(m, "%s %lld %lld ", range->path, range->start,
+			   range->end - range->start);
+		if (status == PREWARM_PENDING) {
+			seq_puts(m, "pending\n");
+			pending++;
+		} else if (status == PREWARM_DONE) {
+			seq_printf(m, "done %lu\n", range->cached);
+			done++;
+		} else if (status == PREWARM_PARTIAL) {
+			seq_printf(m, "partial %lu\n", range->cached);
+			partial++;
+		} else {
+			seq_printf(m, "%d\n", status);
+			failed++;
+		}
+	}
+	mutex_unlock(&prewarm_mutex);
+
+	seq_printf(m, "total pending %u done %u partial %u failed %u\n",
+		   pending, done, partial, failed);
+	return 0;
+}
+
+static int prewarm_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, prewarm_show, inode->i_private);
+}
+
+static const struct file_operations prewarm_fops = {
+	.owner = THIS_MODULE,
+	.open = prewarm_open,
+	.read = seq_read,
+	.write = prewarm_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+enum evict_policy {
+	EVICT_ALWAYS,
+	EVICT_PRESSURE,
+};
+
+static const char *const evict_policy_names[] = {
+	[EVICT_ALWAYS] = "always",
+	[EVICT_PRESSURE] = "pressure",
+};
+
+static DEFINE_STATIC_KEY_FALSE(evict_adaptive);
+
+/*
+ * The memory state sampled by pressure_work. This is the only thing the hooks
+ * look at to decide whether to evict under the 'pressure' policy.
+ */
+static bool under_pressure __read_mostly;
+
+static unsigned int cache_limit_pct = 20;
+module_param(cache_limit_pct, uint, 0644);
+MODULE_PARM_DESC(cache_limit_pct,
+		 "Page cache % of memory to start evicting. Default: 20.");
+
+static unsigned int psi_threshold;
+module_param(psi_threshold, uint, 0644);
+MODULE_PARM_DESC(psi_threshold,
+		 "Memory pressure % to start evicting. Default: 0 (off).");
+
+static unsigned int pressure_interval_ms = 1000;
+module_param(pressure_interval_ms, uint, 0644);
+MODULE_PARM_DESC(pressure_interval_ms,
+		 "Interval to sample the memory state. Default: 1000.");
+
+static int evict_policy = EVICT_ALWAYS;
+
+static void sample_memory_pressure(struct work_struct *work);
+static DECLARE_DELAYED_WORK(pressure_work, sample_memory_pressure);
+
+static void sample_memory_pressure(struct work_struct *work)
+{
+	bool pressure = false;
+	struct sysinfo info;
+
+	if (cache_limit_pct) {
+		unsigned long cached = global_node_page_state(NR_FILE_PAGES);
+
+		si_meminfo(&info);
+		pressure = cached * 100 > info.totalram * cache_limit_pct;
+	}
+
+#ifdef CONFIG_PSI
+	if (!pressure && psi_threshold && READ_ONCE(orig_psi_system)) {
+		unsigned long avg10 =
+			READ_ONCE(orig_psi_system->avg[PSI_MEM_SOME][0]);
+
+		pressure = LOAD_INT(avg10) >= psi_threshold;
+	}
+#endif
+
+	if (READ_ONCE(under_pressure) != pressure)
+		WRITE_ONCE(under_pressure, pressure);
+
+	if (READ_ONCE(evict_policy) == EVICT_PRESSURE)
+		queue_delayed_work(system_power_efficient_wq, &pressure_work,
+				   msecs_to_jiffies(pressure_interval_ms ?: 1));
+}
+
+/*
+ * psi_system is a data symbol, which kallsyms only finds with
+ * CONFIG_KALLSYMS_ALL, so it is resolved on its own when the 'pressure'
+ * policy is selected instead of failing to load the module.
+ */
+static int resolve_psi_system(void)
+{
+#ifdef CONFIG_PSI
+	unsigned long address;
+
+	if (READ_ONCE(orig_psi_system))
+		return 0;
+
+	address = kallsyms_lookup_name("psi_system");
+	if (!address) {
+		pr_warn("unresolved symbol: psi_system\n");
+		return -EOPNOTSUPP;
+	}
+
+	WRITE_ONCE(orig_psi_system, (struct psi_group *)address);
+#endif
+	return 0;
+}
+
+static int evict_policy_set(const char *val, const struct kernel_param *kp)
+{
+	char name[16];
+	int policy, ret;
+
+	/* sysfs_match_string() is only available since v4.13. */
+	strscpy(name, val, sizeof(name));
+	policy = match_string(evict_policy_names,
+			      ARRAY_SIZE(evict_policy_names), strim(name));
+	if (policy < 0)
+		return policy;
+
+	if (policy == EVICT_PRESSURE) {
+		ret = resolve_psi_system();
+		if (ret)
+			return ret;
+	}
+
+	WRITE_ONCE(evict_policy, policy);
+	if (policy == EVICT_PRESSURE) {
+		mod_delayed_work(system_power_efficient_wq, &pressure_work, 0);
+		static_branch_enable(&evict_adaptive);
+	} else {
+		static_branch_disable(&evict_adaptive);
+	}
+
+	return 0;
+}
+
+static int evict_policy_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n", evict_policy_names[evict_policy]);
+}
+
+static const struct kernel_param_ops evict_policy_param_ops = {
+	.set = evict_policy_set,
+	.get = evict_policy_get,
+};
+module_param_cb(evict_policy, &evict_policy_param_ops, &evict_policy, 0644);
+MODULE_PARM_DESC(evict_policy,
+		 "When to evict (always|pressure). Default: always.");
+
+/*
+ * Return false if eviction can be skipped because the system is not under
+ * memory pressure. See the NOTE of 'evict_policy' at the top of this file.
+ */
+static inline bool need_evict(void)
+{
+	if (static_branch_unlikely(&evict_adaptive))
+		return READ_ONCE(under_pressure);
+
+	return true;
+}
+
+/* Evict the range [spos, epos) of the file except the pinned ranges. */
+static void evict_unpinned(struct file *file, loff_t spos, loff_t epos)
+{
+	loff_t pin_spos, pin_epos;
+
+	if (static_branch_unlikely(&prewarm_pinned)) {
+		while (spos < epos &&
+		       prewarm_find_pinned(file->f_mapping->host, spos, epos,
+					   &pin_spos, &pin_epos)) {
+			if (spos < pin_spos)
+				do_fadvise_dontneed(file, spos, pin_spos);
+			spos = pin_epos;
+		}
+		if (spos >= epos)
+			return;
+	}
+
+	do_fadvise_dontneed(file, spos, epos);
+}
+
+/*
+ * Deferred eviction and write-back. Instead of running them in the system
+ * call, the hooks queue them to the submission queue of the device, in the
+ * list of the NUMA node whose CPUs are closest to the pages for eviction, and
+ * to the device for write-back submission. A pool of workers spread over the
+ * nodes drains the busiest queue with works for their own node, and steals
+ * from the busiest queue of all when there is none. A producer waits when its
+ * device has 'deferred_max_depth' works queued, which bounds the pages not
+ * yet evicted or written back when the workers fall behind.
+ */
+#define DEFERRED_BATCH 16
+
+enum deferred_op {
+	DEFERRED_EVICT,
+	DEFERRED_WRITE_BACK,
+	NR_DEFERRED_OPS,
+};
+
+struct deferred_work {
+	struct list_head list;
+	struct file *file;
+	loff_t spos;
+	loff_t epos;
+	enum deferred_op op;
+	int nid; /* the node the work is queued to */
+};
+
+struct deferred_stats {
+	atomic_long_t queued;
+	atomic_long_t local; /* ran on a CPU of the node it was queued to */
+	atomic_long_t remote;
+};
+
+static struct deferred_stats deferred_stats[MAX_NUMNODES];
+
+static DEFINE_STATIC_KEY_FALSE(deferred_enabled);
+
+static unsigned int deferred_max_depth = 1024;
+module_param(deferred_max_depth, uint, 0644);
+MODULE_PARM_DESC(deferred_max_depth,
+		 "Max deferred works queued per device. Default: 1024.");
+
+static unsigned int deferred_workers;
+module_param(deferred_workers, uint, 0444);
+MODULE_PARM_DESC(deferred_workers,
+		 "Number of deferred workers. Default: 0 (one per CPU).");
+
+static DEFINE_MUTEX(evict_workers_mutex); /* protects evict_workers */
+static struct task_struct **evict_workers;
+static unsigned int nr_evict_workers;
+
+/*
+ * The works queued to a node are run by the workers of the nearest node with
+ * CPUs, its home. Each home counts the works pending for its workers, which
+ * wait on its own wait queue, so that producers on different nodes do not
+ * contend on a single counter and wake up only the workers near the pages.
+ */
+struct evict_node {
+	atomic_t pending; /* works queued to the nodes of this home */
+	wait_queue_head_t wait; /* idle workers of this node */
+} ____cacheline_aligned_in_smp;
+
+static struct evict_node evict_nodes[MAX_NUMNODES];
+static int evict_home[MAX_NUMNODES];
+
+static void evict_nodes_init(void)
+{
+	int nid, i;
+
+	for_each_node(nid) {
+		atomic_set(&evict_nodes[nid].pending, 0);
+		init_waitqueue_head(&evict_nodes[nid].wait);
+
+		evict_home[nid] = first_node(node_states[N_CPU]);
+		for_each_node_state(i, N_CPU) {
+			if (node_distance(nid, i) <
+			    node_distance(nid, evict_home[nid]))
+				evict_home[nid] = i;
+		}
+	}
+}
+
+/*
+ * Return true if a worker of @nid has works to run: the ones of its home, or
+ * a backlog of another home whose workers fall behind.
+ */
+static bool evict_node_busy(int nid)
+{
+	int i;
+
+	if (atomic_read(&evict_nodes[nid].pending) > 0)
+		return true;
+
+	for_each_node_state(i, N_CPU) {
+		if (atomic_read(&evict_nodes[i].pending) > DEFERRED_BATCH)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Wake up an idle worker of @home, or, if they are all busy and the works
+ * pile up, an idle worker of another node to steal them.
+ */
+static void evict_wake_worker(int home)
+{
+	int i;
+
+	if (wq_has_sleeper(&evict_nodes[home].wait)) {
+		wake_up(&evict_nodes[home].wait);
+		return;
+	}
+
+	if (atomic_read(&evict_nodes[home].pending) <= DEFERRED_BATCH)
+		return;
+
+	for_each_node_state(i, N_CPU) {
+		if (wq_has_sleeper(&evict_nodes[i].wait)) {
+			wake_up(&evict_nodes[i].wait);
+			return;
+		}
+	}
+}
+
+int sync_file_range(struct file *file, loff_t offset, loff_t nbytes,
+		    unsigned int flags);
+
+static void run_deferred_op(enum deferred_op op, struct file *file,
+			    loff_t spos, loff_t epos)
+{
+	switch (op) {
+	case DEFERRED_EVICT:
+		evict_unpinned(file, spos, epos);
+		break;
+	case DEFERRED_WRITE_BACK:
+		sync_file_range(file, spos, epos - spos, SYNC_FILE_RANGE_WRITE);
+		break;
+	}
+}
+
+static void run_deferred_works(struct list_head *works)
+{
+	struct deferred_work *dw, *tmp;
+
+	list_for_each_entry_safe(dw, tmp, works, list) {
+		if (numa_node_id() == dw->nid)
+			atomic_long_inc(&deferred_stats[dw->nid].local);
+		else
+			atomic_long_inc(&deferred_stats[dw->nid].remote);
+
+		run_deferred_op(dw->op, dw->file, dw->spos, dw->epos);
+
+		list_del(&dw->list);
+		fput(dw->file);
+		kfree(dw);
+	}
+}
+
+/*
+ * Move up to DEFERRED_BATCH works from the list of @nid in @q to @batch, or
+ * from the list of another node if that one is empty.
+ *
+ * Return the number of works moved.
+ */
+static unsigned int evict_queue_pop(struct evict_queue *q, int nid,
+				    struct list_head *batch)
+{
+	struct deferred_work *dw, *tmp;
+	struct list_head *works;
+	unsigned int n = 0;
+	int i, src = nid;
+
+	spin_lock(&q->lock);
+	for (i = 0; list_empty(&q->works[src]) && i < nr_node_ids; i++)
+		src = i;
+
+	works = &q->works[src];
+
+	list_for_each_entry_safe(dw, tmp, works, list) {
+		list_move_tail(&dw->list, batch);
+		if (++n == DEFERRED_BATCH)
+			break;
+	}
+
+	if (src != nid)
+		q->stolen += n;
+	q->depth -= n;
+	spin_unlock(&q->lock);
+
+	if (n) {
+		atomic_sub(n, &evict_nodes[evict_home[src]].pending);
+		if (wq_has_sleeper(&q->wait))
+			wake_up_all(&q->wait);
+	}
+
+	return n;
+}
+
+/*
+ * Pick the queue to drain for a worker on @nid: the busiest one that has
+ * works for @nid, or the busiest one of all to steal from.
+ */
+static struct evict_queue *evict_pick_queue(int nid)
+{
+	struct evict_queue *q, *home = NULL, *busiest = NULL;
+	unsigned int depth, home_depth = 0, busiest_depth = 0;
+
+	/* The queues are only freed after the workers have stopped. */
+	rcu_read_lock();
+	list_for_each_entry_rcu(q, &evict_queues, list) {
+		depth = READ_ONCE(q->depth);
+		if (depth > home_depth && !list_empty(&q->works[nid])) {
+			home = q;
+			home_depth = depth;
+		}
+		if (depth > busiest_depth) {
+			busiest = q;
+			busiest_depth = depth;
+		}
+	}
+	rcu_read_unlock();
+
+	return home ?: busiest;
+}
+
+static int evict_worker_fn(void *data)
+{
+	int nid = (long)data;
+	struct evict_queue *q;
+	LIST_HEAD(batch);
+
+	while (!kthread_should_stop()) {
+		q = evict_pick_queue(nid);
+		if (!q || !evict_queue_pop(q, nid, &batch)) {
+			wait_event_interruptible_exclusive(
+				evict_nodes[nid].wait,
+				evict_node_busy(nid) || kthread_should_stop());
+			continue;
+		}
+
+		run_deferred_works(&batch);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/* Stop the workers and run the works they left behind. */
+static void evict_workers_stop(void)
+{
+	struct evict_queue *q;
+	LIST_HEAD(batch);
+
+	while (nr_evict_workers)
+		kthread_stop(evict_workers[--nr_evict_workers]);
+	kfree(evict_workers);
+	evict_workers = NULL;
+
+	/* This also wakes up the producers waiting for room. */
+	list_for_each_entry(q, &evict_queues, list) {
+		while (evict_queue_pop(q, 0, &batch))
+			run_deferred_works(&batch);
+	}
+}
+
+/*
+ * Start 'deferred_workers' workers, spread evenly over the nodes with CPUs
+ * and bound to the CPUs of their node. Every such node gets at least one, as
+ * its works wake up only its own workers.
+ */
+static int evict_workers_start(void)
+{
+	unsigned int i, nr = deferred_workers ?: num_online_cpus();
+	int nid = first_node(node_states[N_CPU]);
+	struct task_struct *task;
+
+	nr = max_t(unsigned int, nr, num_node_state(N_CPU));
+	evict_workers = kcalloc(nr, sizeof(*evict_workers), GFP_KERNEL);
+	if (!evict_workers)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		task = kthread_create_on_node(evict_worker_fn,
+					      (void *)(long)nid, nid,
+					      KBUILD_MODNAME "_evict/%u", i);
+		if (IS_ERR(task)) {
+			evict_workers_stop();
+			return PTR_ERR(task);
+		}
+
+		set_cpus_allowed_ptr(task, cpumask_of_node(nid));
+		evict_workers[nr_evict_workers++] = task;
+		wake_up_process(task);
+
+		nid = next_node_in(nid, node_states[N_CPU]);
+	}
+
+	return 0;
+}
+
+static bool deferred;
+static bool evict_workers_ready; /* the module has been initialized */
+
+/* Start or stop the workers according to the 'deferred' parameter. */
+static int evict_workers_update(void)
+{
+	int ret = 0;
+
+	mutex_lock(&evict_workers_mutex);
+	if (deferred && !evict_workers && evict_workers_ready)
+		ret = evict_workers_start();
+	else if (!deferred && evict_workers)
+		evict_workers_stop();
+	mutex_unlock(&evict_workers_mutex);
+
+	return ret;
+}
+
+static int deferred_set(const char *val, const struct kernel_param *kp)
+{
+	int ret = param_set_bool_key(val, kp, &deferred_enabled.key, true);
+
+	if (ret)
+		return ret;
+
+	return evict_workers_update();
+}
+
+static const struct kernel_param_ops deferred_param_ops = {
+	.set = deferred_set,
+	.get = param_get_bool,
+};
+module_param_cb(deferred, &deferred_param_ops, &deferred, 0644);
+MODULE_PARM_DESC(deferred,
+		 "Enable/Disable deferring eviction to workers. Default: N.");
+
+/* Return the node of the page cached at @pos, or NUMA_NO_NODE. */
+static int page_node(struct file *file, loff_t pos)
+{
+	struct page *page = find_get_page(file->f_mapping, pos >> PAGE_SHIFT);
+	int nid;
+
+	if (!page)
+		return NUMA_NO_NODE;
+
+	nid = page_to_nid(page);
+	put_page(page);
+	return nid;
+}
+
+/* Return the node of the request queue of the device, or NUMA_NO_NODE. */
+static int device_node(struct file *file)
+{
+	struct block_device *bdev = file_bdev(file);
+
+	if (!bdev)
+		return NUMA_NO_NODE;
+
+	return bdev_get_queue(bdev)->node;
+}
+
+/*
+ * Choose the node to run @op on. Eviction walks the pages, so it prefers the
+ * node of the pages, while write-back submits bios, so it prefers the node
+ * of the device. Each falls back to the other, and then to the local node.
+ */
+static int deferred_node(enum deferred_op op, struct file *file, loff_t spos)
+{
+	int nid;
+
+	if (op == DEFERRED_EVICT) {
+		nid = page_node(file, spos);
+		if (nid == NUMA_NO_NODE)
+			nid = device_node(file);
+	} else {
+		nid = device_node(file);
+		if (nid == NUMA_NO_NODE)
+			nid = page_node(file, spos);
+	}
+
+	if (nid == NUMA_NO_NODE || !node_online(nid))
+		nid = numa_node_id();
+
+	return nid;
+}
+
+/*
+ * Run @op on the range [spos, epos) of the file, or queue it to the
+ * submission queue of @dev if 'deferred' is enabled.
+ */
+static void run_or_defer(enum deferred_op op, struct file *file, loff_t spos,
+			 loff_t epos, struct fscache_device *dev)
+{
+	unsigned int max_depth = READ_ONCE(deferred_max_depth);
+	struct evict_queue *q = dev->queue;
+	struct deferred_work *dw;
+	bool throttled = false;
+	int nid;
+
+	if (!static_branch_unlikely(&deferred_enabled) || !nr_evict_workers)
+		goto run;
+
+	if (max_depth && READ_ONCE(q->depth) >= max_depth) {
+		throttled = true;
+		if (wait_event_killable(q->wait,
+					READ_ONCE(q->depth) < max_depth ||
+					!READ_ONCE(nr_evict_workers)) ||
+		    !READ_ONCE(nr_evict_workers))
+			goto run;
+	}
+
+	nid = deferred_node(op, file, spos);
+	dw = kmalloc_node(sizeof(*dw), GFP_KERNEL, nid);
+	if (!dw)
+		goto run;
+
+	/*
+	 * The pages just read may still be in the LRU pagevecs of this CPU,
+	 * where the worker cannot invalidate them.
+	 */
+	if (op == DEFERRED_EVICT)
+		lru_add_drain();
+
+	dw->file = get_file(file);
+	dw->spos = spos;
+	dw->epos = epos;
+	dw->op = op;
+	dw->nid = nid;
+
+	spin_lock(&q->lock);
+	/* Pairs with the lock taken to drain the queue when stopping. */
+	if (!nr_evict_workers) {
+		spin_unlock(&q->lock);
+		fput(dw->file);
+		kfree(dw);
+		goto run;
+	}
+	/* Counted before it is published, so a worker never sees it early. */
+	atomic_inc(&evict_nodes[evict_home[nid]].pending);
+	list_add_tail(&dw->list, &q->works[nid]);
+	q->depth++;
+	q->queued++;
+	if (throttled)
+		q->throttled++;
+	spin_unlock(&q->lock);
+
+	atomic_long_inc(&deferred_stats[nid].queued);
+	evict_wake_worker(evict_home[nid]);
+	return;
+
+run:
+	run_deferred_op(op, file, spos, epos);
+}
+
+static int deferred_show(struct seq_file *m, void *v)
+{
+	struct evict_queue *q;
+	int nid;
+
+	seq_printf(m, "workers %u\n", nr_evict_workers);
+
+	for_each_online_node(nid) {
+		struct deferred_stats *stats = &deferred_stats[nid];
+
+		seq_printf(m,
+			   "node %d home %d pending %d queued %ld local %ld remote %ld\n",
+			   nid, evict_home[nid],
+			   atomic_read(&evict_nodes[nid].pending),
+			   atomic_long_read(&stats->queued),
+			   atomic_long_read(&stats->local),
+			   atomic_long_read(&stats->remote));
+	}
+
+	mutex_lock(&evict_queues_mutex);
+	list_for_each_entry(q, &evict_queues, list) {
+		seq_printf(m,
+			   "device %u:%u depth %u queued %lu stolen %lu throttled %lu\n",
+			   MAJOR(q->devt), MINOR(q->devt), READ_ONCE(q->depth),
+			   READ_ONCE(q->queued), READ_ONCE(q->stolen),
+			   READ_ONCE(q->throttled));
+	}
+	mutex_unlock(&evict_queues_mutex);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(deferred);
+
+/*
+ * Pages partially accessed at the ends of the last read and the last write
+ * of each opened file. Evicting or writing back such a page right away would
+ * evict the rest of it before it is read, or write it back again and again
+ * as it is filled by small writes, so it is deferred until the next access
+ * of the same kind shows whether that end is continued. If it is not, or the
+ * file is released, the page is evicted or written back on its own.
+ */
+#define PARTIAL_HASH_BITS 10
+
+struct partial_access {
+	struct hlist_bl_node hnode; /* in partial_table */
+	struct file *file;
+	/* indexed by enum deferred_op, -1 if the page is not deferred */
+	loff_t spos[NR_DEFERRED_OPS]; /* in the partial page at the start */
+	loff_t epos[NR_DEFERRED_OPS]; /* in the partial page at the end */
+};
+
+static struct hlist_bl_head partial_table[1 << PARTIAL_HASH_BITS];
+/* Enabled once a partial page is deferred, so that release looks it up. */
+static DEFINE_STATIC_KEY_FALSE(partial_tracked);
+
+static inline struct hlist_bl_head *partial_head(struct file *file)
+{
+	return &partial_table[hash_ptr(file, PARTIAL_HASH_BITS)];
+}
+
+static struct partial_access *partial_find(struct hlist_bl_head *head,
+					   struct file *file)
+{
+	struct partial_access *pa;
+	struct hlist_bl_node *node;
+
+	hlist_bl_for_each_entry(pa, node, head, hnode) {
+		if (pa->file == file)
+			return pa;
+	}
+	return NULL;
+}
+
+/*
+ * Record the partial pages deferred by the @op access [spos, epos) of the
+ * file, and return the ones deferred by the previous @op access in
+ * *prev_spos and *prev_epos. A partial page is not deferred again if the
+ * access continues the previous one from that end.
+ */
+static void partial_update(struct file *file, enum deferred_op op,
+			   loff_t spos, loff_t epos, bool head_partial,
+			   bool tail_partial, loff_t *prev_spos,
+			   loff_t *prev_epos)
+{
+	struct hlist_bl_head *head = partial_head(file);
+	struct partial_access *pa, *new = NULL;
+	int i;
+
+retry:
+	*prev_spos = *prev_epos = -1;
+
+	hlist_bl_lock(head);
+	pa = partial_find(head, file);
+	if (!pa && new) {
+		hlist_bl_add_head(&new->hnode, head);
+		swap(pa, new);
+	}
+	if (pa) {
+		*prev_spos = pa->spos[op];
+		*prev_epos = pa->epos[op];
+		pa->spos[op] = head_partial && spos != *prev_epos ? spos : -1;
+		pa->epos[op] = tail_partial && epos != *prev_spos ? epos : -1;
+	}
+	hlist_bl_unlock(head);
+
+	if (!pa && !new && (head_partial || tail_partial)) {
+		new = kmalloc(sizeof(*new), GFP_KERNEL);
+		if (!new)
+			return;
+
+		new->file = file;
+		for (i = 0; i < NR_DEFERRED_OPS; i++)
+			new->spos[i] = new->epos[i] = -1;
+
+		static_branch_enable(&partial_tracked);
+		goto retry;
+	}
+
+	kfree(new);
+}
+
+/*
+ * Run @op on the cached pages spanning @pos of the file unless they overlap
+ * the pages [first, last) of the current access, which either covers them or
+ * defers them again.
+ */
+static void run_on_partial(enum deferred_op op, struct file *file, loff_t pos,
+			   pgoff_t first, pgoff_t last,
+			   struct fscache_device *dev)
+{
+	pgoff_t pfirst, plast;
+
+	if (pos < 0)
+		return;
+
+	cached_page_span(file->f_mapping, pos >> PAGE_SHIFT, &pfirst, &plast);
+	if (plast > first && pfirst < last)
+		return;
+
+	if (dev)
+		run_or_defer(op, file, (loff_t)pfirst << PAGE_SHIFT,
+			     (loff_t)plast << PAGE_SHIFT, dev);
+	else
+		run_deferred_op(op, file, (loff_t)pfirst << PAGE_SHIFT,
+				(loff_t)plast << PAGE_SHIFT);
+}
+
+/*
+ * Run @op on the cached pages fully accessed by [spos, epos) of the file, so
+ * that a page is evicted or written back only after all of it has been
+ * accessed. The partially accessed pages at both ends are deferred, except
+ * the last page of the file if @op is DEFERRED_EVICT. The ones deferred by
+ * the previous access are covered if this access continues from there, and
+ * are run on their own otherwise.
+ */
+static void run_on_accessed(enum deferred_op op, struct file *file,
+			    loff_t spos, loff_t epos,
+			    struct fscache_device *dev)
+{
+	struct address_space *mapping = file->f_mapping;
+	pgoff_t first, last, tail_first, tail_last, start, end;
+	loff_t prev_spos, prev_epos;
+	bool head_partial, tail_partial;
+
+	if (epos <= spos)
+		return;
+
+	cached_page_span(mapping, spos >> PAGE_SHIFT, &first, &last);
+	cached_page_span(mapping, (epos - 1) >> PAGE_SHIFT, &tail_first,
+			 &tail_last);
+
+	head_partial = spos > ((loff_t)first << PAGE_SHIFT);
+	tail_partial = epos < ((loff_t)tail_last << PAGE_SHIFT) &&
+		       !(op == DEFERRED_EVICT &&
+			 epos >= i_size_read(mapping->host));
+
+	partial_update(file, op, spos, epos, head_partial, tail_partial,
+		       &prev_spos, &prev_epos);
+
+	start = head_partial && spos != prev_epos ? last : first;
+	end = tail_partial && epos != prev_spos ? tail_first : tail_last;
+	if (start < end)
+		run_or_defer(op, file, (loff_t)start << PAGE_SHIFT,
+			     (loff_t)end << PAGE_SHIFT, dev);
+
+	if (prev_epos != spos)
+		run_on_partial(op, file, prev_epos, first, tail_last, dev);
+	/* Both ends of the previous access may be in the same page. */
+	if (prev_spos != epos &&
+	    (prev_epos < 0 || (prev_spos ^ prev_epos) >> PAGE_SHIFT))
+		run_on_partial(op, file, prev_spos, first, tail_last, dev);
+}
+
+/* Run the deferred partial pages of the file when it is released. */
+/*
+ * Return true if @op is still to be run after the accesses to @dev, which
+ * may have been turned off since the partial pages were deferred.
+ */
+static bool partial_op_enabled(enum deferred_op op,
+			       struct fscache_device *dev)
+{
+	if (op == DEFERRED_EVICT)
+		return static_branch_likely(&evict_read_enabled);
+
+	return static_branch_likely(&evict_write_enabled) &&
+	       dev->write_mode == WRITE_MODE_START;
+}
+
+static void partial_release(struct file *file)
+{
+	struct hlist_bl_head *head = partial_head(file);
+	struct partial_access *pa;
+	struct fscache_device dev;
+	bool affected;
+	int i;
+
+	hlist_bl_lock(head);
+	pa = partial_find(head, file);
+	if (pa)
+		hlist_bl_del(&pa->hnode);
+	hlist_bl_unlock(head);
+
+	if (!pa)
+		return;
+
+	/* The device may have been removed from 'no_fscache_device'. */
+	affected = lookup_device(file, &dev);
+
+	/*
+	 * The file is being released, so it cannot be queued to the workers,
+	 * which would take a reference to it.
+	 */
+	for (i = 0; i < NR_DEFERRED_OPS; i++) {
+		if (!affected || !partial_op_enabled(i, &dev))
+			continue;
+
+		run_on_partial(i, file, pa->spos[i], 0, 0, NULL);
+		if (pa->epos[i] < 0 || pa->spos[i] < 0 ||
+		    (pa->spos[i] ^ pa->epos[i]) >> PAGE_SHIFT)
+			run_on_partial(i, file, pa->epos[i], 0, 0, NULL);
+	}
+	kfree(pa);
+}
+
+static void partial_free_all(void)
+{
+	struct partial_access *pa;
+	struct hlist_bl_node *node, *tmp;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(partial_table); i++) {
+		hlist_bl_for_each_entry_safe(pa, node, tmp, &partial_table[i],
+					     hnode)
+			kfree(pa);
+		INIT_HLIST_BL_HEAD(&partial_table[i]);
+	}
+}
+
+/* Return true if any feature affecting read system calls is enabled. */
+static inline bool read_hooks_enabled(void)
+{
+	return static_branch_likely(&evict_read_enabled) ||
+	       static_branch_unlikely(&mrc_enabled) ||
+	       static_branch_unlikely(&iotrace_enabled);
+}
+
+/* Return true if any feature affecting write system calls is enabled. */
+static inline bool write_hooks_enabled(void)
+{
+	return static_branch_likely(&evict_write_enabled) ||
+	       static_branch_unlikely(&mrc_enabled) ||
+	       static_branch_unlikely(&iotrace_enabled);
+}
+
+/*
+ * @ret: the return value from read/write system calls
+ * @file: the struct file pointer of the file descriptor
+ * @pos: the current reading or writing position in the file
+ *	 System call
+ *	 pread64()/pwrite64()/preadv()/pwritev()/preadv2()/pwritev2()
+ *	 do not update the file offset at the end, so we can't get
+ *	 this information through file->f_pos.
+ * @start: the return value of iotrace_clock() before the read
+ */
+static inline void fadvise_dontneed(ssize_t ret, struct file *file,
+				    loff_t pos, u64 start)
+{
+	umode_t i_mode = file_inode(file)->i_mode;
+	unsigned long nrpages = file->f_mapping->nrpages;
+	struct fscache_device dev;
+
+	if (!read_hooks_enabled())
+		return;
+
+	if (ret <= 0 || !is_cached_file(i_mode) || is_direct(file) ||
+	    !lookup_device(file, &dev))
+		return;
+
+	mrc_access(dev.mrc, file, pos - ret, ret);
+
+	if (static_branch_likely(&evict_read_enabled) && need_evict())
+		run_on_accessed(DEFERRED_EVICT, file, pos - ret, pos, &dev);
+
+	iotrace_record(NOFSCACHE_TRACE_READ, file, pos - ret, ret, start,
+		       nrpages);
+}
+
+static asmlinkage long no_fscache_sys_read(unsigned int fd, char __user *buf,
+					   size_t count)
+{
+	struct fd f = orig_fdget_pos(fd);
+	ssize_t ret = -EBADF;
+	u64 start = iotrace_clock();
+
+	if (f.file) {
+		loff_t pos, *ppos = file_ppos(f.file);
+
+		if (ppos) {
+			pos = *ppos;
+			ppos = &pos;
+		}
+		ret = orig_vfs_read(f.file, buf, count, ppos);
+		if (ret >= 0 && ppos)
+			f.file->f_pos = pos;
+		orig_f_unlock_pos(&f);
+
+		if (ppos)
+			fadvise_dontneed(ret, f.file, pos, start);
+		orig_fdput_pos(f);
+	}
+	return ret;
+}
+
+static ssize_t do_readv(unsigned long fd, const struct iovec __user *vec,
+			unsigned long vlen, rwf_t flags)
+{
+	struct fd f = orig_fdget_pos(fd);
+	ssize_t ret = -EBADF;
+	u64 start = iotrace_clock();
+
+	if (f.file) {
+		loff_t pos, *ppos = file_ppos(f.file);
+
+		if (ppos) {
+			pos = *ppos;
+			ppos = &pos;
+		}
+		ret = orig_vfs_readv(f.file, vec, vlen, ppos, flags);
+		if (ret >= 0 && ppos)
+			f.file->f_pos = pos;
+		orig_f_unlock_pos(&f);
+
+		if (ppos)
+			fadvise_dontneed(ret, f.file, pos, start);
+		orig_fdput_pos(f);
+	}
+
+	if (ret > 0)
+		add_rchar(current, ret);
+	inc_syscr(current);
+	return ret;
+}
+
+static asmlinkage long no_fscache_sys_readv(unsigned long fd,
+					    const struct iovec __user *vec,
+					    unsigned long vlen)
+{
+	return do_readv(fd, vec, vlen, 0);
+}
+
+static asmlinkage long no_fscache_sys_pread64(unsigned int fd, char __user *buf,
+					      size_t count, loff_t pos)
+{
+	struct fd f;
+	ssize_t ret = -EBADF;
+	u64 start = iotrace_clock();
+
+	if (pos < 0)
+		return -EINVAL;
+
+	f = fdget(fd);
+	if (f.file) {
+		ret = -ESPIPE;
+		if (f.file->f_mode & FMODE_PREAD)
+			ret = orig_vfs_read(f.file, buf, count, &pos);
+
+		fadvise_dontneed(ret, f.file, pos, start);
+		fdput(f);
+	}
+
+	return ret;
+}
+
+static inline loff_t pos_from_hilo(unsigned long high, unsigned long low)
+{
+#define HALF_LONG_BITS (BITS_PER_LONG / 2)
+	return (((loff_t)high << HALF_LONG_BITS) << HALF_LONG_BITS) | low;
+}
+
+static ssize_t do_preadv(unsigned long fd, const struct iovec __user *vec,
+			 unsigned long vlen, loff_t pos, rwf_t flags)
+{
+	struct fd f;
+	ssize_t ret = -EBADF;
+	u64 start = iotrace_clock();
+
+	if (pos < 0)
+		return -EINVAL;
+
+	f = fdget(fd);
+	if (f.file) {
+		ret = -ESPIPE;
+		if (f.file->f_mode & FMODE_PREAD)
+			ret = orig_vfs_readv(f.file, vec, vlen, &pos, flags);
+
+		fadvise_dontneed(ret, f.file, pos, start);
+		fdput(f);
+	}
+
+	if (ret > 0)
+		add_rchar(current, ret);
+	inc_syscr(current);
+	return ret;
 }
 
-/*
- * This function is enhanced based on
- * io_is_direct() from
- *	https://elixir.bootlin.com/linux/v5.3.6/source/include/linux/fs.h#L3304
- * xfs_file_read_iter() from
- *	https://elixir.bootlin.com/linux/v5.3.6/source/fs/xfs/xfs_file.c#L261
- * and xfs_file_write_iter() from
- *	https://elixir.bootlin.com/linux/v5.3.6/source/fs/xfs/xfs_file.c#L706
- */
-static inline bool is_direct(struct file *filp)
+static asmlinkage long no_fscache_sys_preadv(unsigned long fd,
+					     const struct iovec __user *vec,
+					     unsigned long vlen,
+					     unsigned long pos_l,
+					     unsigned long pos_h)
 {
-	return (filp->f_flags & O_DIRECT) || IS_DAX(filp->f_mapping->host) ||
-	       IS_DAX(file_inode(filp));
+	loff_t pos = pos_from_hilo(pos_h, pos_l);
+
+	return do_preadv(fd, vec, vlen, pos, 0);
 }
 
-/*
- * @ret: the return value from read/write system calls
- * @file: the struct file pointer of the file descriptor (%fd)
- * @fd: the file descriptor passed to read/write system calls
- * @pos: the current reading or writing position in the file
- *	 System call
- *	 pread64()/pwrite64()/preadv()/pwritev()/preadv2()/pwritev2()
- *	 do not update the file offset at the end, so we can't get
- *	 this information through file->f_pos.
- */
-static inline void fadvise_dontneed(ssize_t ret, struct file *file,
-				    unsigned int fd, loff_t pos)
+static asmlinkage long no_fscache_sys_preadv2(unsigned long fd,
+					      const struct iovec __user *vec,
+					      unsigned long vlen,
+					      unsigned long pos_l,
+					      unsigned long pos_h, rwf_t flags)
+{
+	loff_t pos = pos_from_hilo(pos_h, pos_l);
+
+	if (pos == -1)
+		return do_readv(fd, vec, vlen, flags);
+
+	return do_preadv(fd, vec, vlen, pos, flags);
+}
+
+#define VALID_FLAGS                                                            \
+	(SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |                 \
+	 SYNC_FILE_RANGE_WAIT_AFTER)
+
+#define SYNC_FILE_RANGE_WRITE_AND_WAIT                                         \
+	(SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_BEFORE |                 \
+	 SYNC_FILE_RANGE_WAIT_AFTER)
+
+int sync_file_range(struct file *file, loff_t offset, loff_t nbytes,
+		    unsigned int flags)
+{
+	int ret;
+	struct address_space *mapping;
+	loff_t endbyte; /* inclusive */
+	umode_t i_mode;
+
+	ret = -EINVAL;
+	if (flags & ~VALID_FLAGS)
+		goto out;
+
+	endbyte = offset + nbytes;
+
+	if ((s64)offset < 0)
+		goto out;
+	if ((s64)endbyte < 0)
+		goto out;
+	if (endbyte < offset)
+		goto out;
+
+	if (sizeof(pgoff_t) == 4) {
+		if (offset >= (0x100000000ULL << PAGE_SHIFT)) {
+			/*
+			 * The range starts outside a 32 bit machine's
+			 * pagecache addressing capabilities.  Let it "succeed"
+			 */
+			ret = 0;
+			goto out;
+		}
+		if (endbyte >= (0x100000000ULL << PAGE_SHIFT)) {
+			/*
+			 * Out to EOF
+			 */
+			nbytes = 0;
+		}
+	}
+
+	if (nbytes == 0)
+		endbyte = LLONG_MAX;
+	else
+		endbyte--; /* inclusive */
+
+	i_mode = file_inode(file)->i_mode;
+	ret = -ESPIPE;
+	if (!S_ISREG(i_mode) && !S_ISBLK(i_mode) && !S_ISDIR(i_mode) &&
+	    !S_ISLNK(i_mode))
+		goto out;
+
+	mapping = file->f_mapping;
+	ret = 0;
+	if (flags & SYNC_FILE_RANGE_WAIT_BEFORE) {
+		ret = file_fdatawait_range(file, offset, endbyte);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (flags & SYNC_FILE_RANGE_WRITE) {
+		int sync_mode = WB_SYNC_NONE;
+
+		if ((flags & SYNC_FILE_RANGE_WRITE_AND_WAIT) ==
+		    SYNC_FILE_RANGE_WRITE_AND_WAIT)
+			sync_mode = WB_SYNC_ALL;
+
+		ret = __orig_filemap_fdatawrite_range(mapping, offset, endbyte,
+						      sync_mode);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (flags & SYNC_FILE_RANGE_WAIT_AFTER)
+		ret = file_fdatawait_range(file, offset, endbyte);
+
+out:
+	return ret;
+}
+
+/* Write back the written range according to the write mode of the device. */
+static void write_back(struct file *file, loff_t offset, ssize_t ret,
+		       struct fscache_device *dev)
+{
+	switch (dev->write_mode) {
+	case WRITE_MODE_START:
+		/*
+		 * we use this function instead of O_DSYNC to sync
+		 * dirty pages to disk because it does not flush disk
+		 * caches. See the description of ksys_sync_file_range()
+		 * https://elixir.bootlin.com/linux/v5.3.6/source/fs/sync.c#L364
+		 *
+		 * The partially written pages at the ends are left dirty,
+		 * even at the end of file, so that appending small blocks
+		 * does not wait for the write back of the same page again
+		 * and again. See run_on_accessed().
+		 */
+		run_on_accessed(DEFERRED_WRITE_BACK, file, offset,
+				offset + ret, dev);
+		break;
+	case WRITE_MODE_WAIT:
+		sync_file_range(file, offset, ret,
+				SYNC_FILE_RANGE_WRITE_AND_WAIT);
+		break;
+	case WRITE_MODE_SYNC:
+		/*
+		 * This is what O_DSYNC does after each write. The file system
+		 * writes back the range together with the metadata needed to
+		 * retrieve it, and then flushes the volatile write cache of
+		 * the device (or uses FUA writes if the device supports it).
+		 * See generic_write_sync()
+		 * https://elixir.bootlin.com/linux/v5.3.6/source/include/linux/fs.h#L2837
+		 */
+		vfs_fsync_range(file, offset, offset + ret - 1, 1);
+		break;
+	}
+}
+
+static inline void async_with_disk(struct file *file, loff_t offset,
+				   ssize_t ret, u64 start)
 {
 	umode_t i_mode = file_inode(file)->i_mode;
+	struct fscache_device dev;
+
+	if (!write_hooks_enabled())
+		return;
+
+	if (ret <= 0 || !is_cached_file(i_mode) || is_direct(file) ||
+	    !lookup_device(file, &dev))
+		return;
+
+	mrc_access(dev.mrc, file, offset, ret);
 
-	if (ret > 0 && S_ISREG(i_mode) && !is_direct(file))
-		do_fadvise_dontneed(fd, pos - ret, pos);
+	if (static_branch_likely(&evict_write_enabled))
+		write_back(file, offset, ret, &dev);
+
+	iotrace_record(NOFSCACHE_TRACE_WRITE, file, offset, ret, start,
+		       file->f_mapping->nrpages);
 }
 
-static asmlinkage long no_fscache_sys_read(unsigned int fd, char __user *buf,
-					   size_t count)
+static asmlinkage long
+no_fscache_sys_write(unsigned int fd, const char __user *buf, size_t count)
 {
 	struct fd f = orig_fdget_pos(fd);
 	ssize_t ret = -EBADF;
+	u64 start = iotrace_clock();
 
 	if (f.file) {
 		loff_t pos, *ppos = file_ppos(f.file);
@@ -408,21 +3242,127 @@ static asmlinkage long no_fscache_sys_read(unsigned int fd, char __user *buf,
 			pos = *ppos;
 			ppos = &pos;
 		}
-		ret = orig_vfs_read(f.file, buf, count, ppos);
+		ret = orig_vfs_write(f.file, buf, count, ppos);
 		if (ret >= 0 && ppos)
 			f.file->f_pos = pos;
+		orig_f_unlock_pos(&f);
+
+		if (ppos)
+			async_with_disk(f.file, pos - ret, ret, start);
 		orig_fdput_pos(f);
+	}
+
+	return ret;
+}
+
+static ssize_t do_iter_readv_writev(struct file *filp, struct iov_iter *iter,
+				    loff_t *ppos, int type, rwf_t flags)
+{
+	struct kiocb kiocb;
+	ssize_t ret;
+
+	init_sync_kiocb(&kiocb, filp);
+	ret = kiocb_set_rw_flags(&kiocb, flags);
+	if (ret)
+		return ret;
+	kiocb.ki_pos = (ppos ? *ppos : 0);
+
+	if (type == READ)
+		ret = call_read_iter(filp, &kiocb, iter);
+	else
+		ret = call_write_iter(filp, &kiocb, iter);
+	BUG_ON(ret == -EIOCBQUEUED);
+	if (ppos)
+		*ppos = kiocb.ki_pos;
+	return ret;
+}
+
+/* Do it by hand, with file-ops */
+static ssize_t do_loop_readv_writev(struct file *filp, struct iov_iter *iter,
+				    loff_t *ppos, int type, rwf_t flags)
+{
+	ssize_t ret = 0;
+
+	if (flags & ~RWF_HIPRI)
+		return -EOPNOTSUPP;
+
+	while (iov_iter_count(iter)) {
+		struct iovec iovec = iov_iter_iovec(iter);
+		ssize_t nr;
+
+		if (type == READ) {
+			nr = filp->f_op->read(filp, iovec.iov_base,
+					      iovec.iov_len, ppos);
+		} else {
+			nr = filp->f_op->write(filp, iovec.iov_base,
+					       iovec.iov_len, ppos);
+		}
+
+		if (nr < 0) {
+			if (!ret)
+				ret = nr;
+			break;
+		}
+		ret += nr;
+		if (nr != iovec.iov_len)
+			break;
+		iov_iter_advance(iter, nr);
+	}
+
+	return ret;
+}
+
+static ssize_t do_iter_write(struct file *file, struct iov_iter *iter,
+			     loff_t *pos, rwf_t flags)
+{
+	size_t tot_len;
+	ssize_t ret = 0;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (!(file->f_mode & FMODE_CAN_WRITE))
+		return -EINVAL;
+
+	tot_len = iov_iter_count(iter);
+	if (!tot_len)
+		return 0;
+	ret = rw_verify_area(WRITE, file, pos, tot_len);
+	if (ret < 0)
+		return ret;
+
+	if (file->f_op->write_iter)
+		ret = do_iter_readv_writev(file, iter, pos, WRITE, flags);
+	else
+		ret = do_loop_readv_writev(file, iter, pos, WRITE, flags);
+	if (ret > 0)
+		fsnotify_modify(file);
+	return ret;
+}
 
-		fadvise_dontneed(ret, f.file, fd, f.file->f_pos);
+static ssize_t vfs_writev(struct file *file, const struct iovec __user *vec,
+			  unsigned long vlen, loff_t *pos, rwf_t flags)
+{
+	struct iovec iovstack[UIO_FASTIOV];
+	struct iovec *iov = iovstack;
+	struct iov_iter iter;
+	ssize_t ret;
+
+	ret = import_iovec(WRITE, vec, vlen, ARRAY_SIZE(iovstack), &iov, &iter);
+	if (ret >= 0) {
+		file_start_write(file);
+		ret = do_iter_write(file, &iter, pos, flags);
+		file_end_write(file);
+		kfree(iov);
 	}
 	return ret;
 }
 
-static ssize_t do_readv(unsigned long fd, const struct iovec __user *vec,
-			unsigned long vlen, rwf_t flags)
+static ssize_t do_writev(unsigned long fd, const struct iovec __user *vec,
+			 unsigned long vlen, rwf_t flags)
 {
 	struct fd f = orig_fdget_pos(fd);
 	ssize_t ret = -EBADF;
+	u64 start = iotrace_clock();
 
 	if (f.file) {
 		loff_t pos, *ppos = file_ppos(f.file);
@@ -431,32 +3371,36 @@ static ssize_t do_readv(unsigned long fd, const struct iovec __user *vec,
 			pos = *ppos;
 			ppos = &pos;
 		}
-		ret = orig_vfs_readv(f.file, vec, vlen, ppos, flags);
+		ret = vfs_writev(f.file, vec, vlen, ppos, flags);
 		if (ret >= 0 && ppos)
 			f.file->f_pos = pos;
-		orig_fdput_pos(f);
+		orig_f_unlock_pos(&f);
 
-		fadvise_dontneed(ret, f.file, fd, f.file->f_pos);
+		if (ppos)
+			async_with_disk(f.file, pos - ret, ret, start);
+		orig_fdput_pos(f);
 	}
 
 	if (ret > 0)
-		add_rchar(current, ret);
-	inc_syscr(current);
+		add_wchar(current, ret);
+	inc_syscw(current);
 	return ret;
 }
 
-static asmlinkage long no_fscache_sys_readv(unsigned long fd,
-					    const struct iovec __user *vec,
-					    unsigned long vlen)
+static asmlinkage long no_fscache_sys_writev(unsigned long fd,
+					     const struct iovec __user *vec,
+					     unsigned long vlen)
 {
-	return do_readv(fd, vec, vlen, 0);
+	return do_writev(fd, vec, vlen, 0);
 }
 
-static asmlinkage long no_fscache_sys_pread64(unsigned int fd, char __user *buf,
-					      size_t count, loff_t pos)
+static asmlinkage long no_fscache_sys_pwrite64(unsigned int fd,
+					       const char __user *buf,
+					       size_t count, loff_t pos)
 {
 	struct fd f;
 	ssize_t ret = -EBADF;
+	u64 start = iotrace_clock();
 
 	if (pos < 0)
 		return -EINVAL;
@@ -464,27 +3408,22 @@ static asmlinkage long no_fscache_sys_pread64(unsigned int fd, char __user *buf,
 	f = fdget(fd);
 	if (f.file) {
 		ret = -ESPIPE;
-		if (f.file->f_mode & FMODE_PREAD)
-			ret = orig_vfs_read(f.file, buf, count, &pos);
-		fdput(f);
+		if (f.file->f_mode & FMODE_PWRITE)
+			ret = orig_vfs_write(f.file, buf, count, &pos);
 
-		fadvise_dontneed(ret, f.file, fd, pos);
+		async_with_disk(f.file, pos - ret, ret, start);
+		fdput(f);
 	}
 
 	return ret;
 }
 
-static inline loff_t pos_from_hilo(unsigned long high, unsigned long low)
-{
-#define HALF_LONG_BITS (BITS_PER_LONG / 2)
-	return (((loff_t)high << HALF_LONG_BITS) << HALF_LONG_BITS) | low;
-}
-
-static ssize_t do_preadv(unsigned long fd, const struct iovec __user *vec,
-			 unsigned long vlen, loff_t pos, rwf_t flags)
+static ssize_t do_pwritev(unsigned long fd, const struct iovec __user *vec,
+			  unsigned long vlen, loff_t pos, rwf_t flags)
 {
 	struct fd f;
 	ssize_t ret = -EBADF;
+	u64 start = iotrace_clock();
 
 	if (pos < 0)
 		return -EINVAL;
@@ -492,376 +3431,802 @@ static ssize_t do_preadv(unsigned long fd, const struct iovec __user *vec,
 	f = fdget(fd);
 	if (f.file) {
 		ret = -ESPIPE;
-		if (f.file->f_mode & FMODE_PREAD)
-			ret = orig_vfs_readv(f.file, vec, vlen, &pos, flags);
-		fdput(f);
+		if (f.file->f_mode & FMODE_PWRITE)
+			ret = vfs_writev(f.file, vec, vlen, &pos, flags);
 
-		fadvise_dontneed(ret, f.file, fd, pos);
+		async_with_disk(f.file, pos - ret, ret, start);
+		fdput(f);
 	}
 
 	if (ret > 0)
-		add_rchar(current, ret);
-	inc_syscr(current);
+		add_wchar(current, ret);
+	inc_syscw(current);
 	return ret;
 }
 
-static asmlinkage long no_fscache_sys_preadv(unsigned long fd,
-					     const struct iovec __user *vec,
-					     unsigned long vlen,
-					     unsigned long pos_l,
-					     unsigned long pos_h)
+static asmlinkage long no_fscache_sys_pwritev(unsigned long fd,
+					      const struct iovec __user *vec,
+					      unsigned long vlen,
+					      unsigned long pos_l,
+					      unsigned long pos_h)
 {
 	loff_t pos = pos_from_hilo(pos_h, pos_l);
 
-	return do_preadv(fd, vec, vlen, pos, 0);
+	return do_pwritev(fd, vec, vlen, pos, 0);
 }
 
-static asmlinkage long no_fscache_sys_preadv2(unsigned long fd,
-					      const struct iovec __user *vec,
-					      unsigned long vlen,
-					      unsigned long pos_l,
-					      unsigned long pos_h, rwf_t flags)
+static asmlinkage long no_fscache_sys_pwritev2(unsigned long fd,
+					       const struct iovec __user *vec,
+					       unsigned long vlen,
+					       unsigned long pos_l,
+					       unsigned long pos_h, rwf_t flags)
 {
 	loff_t pos = pos_from_hilo(pos_h, pos_l);
 
 	if (pos == -1)
-		return do_readv(fd, vec, vlen, flags);
+		return do_writev(fd, vec, vlen, flags);
 
-	return do_preadv(fd, vec, vlen, pos, flags);
+	return do_pwritev(fd, vec, vlen, pos, flags);
 }
 
-#define VALID_FLAGS                                                            \
-	(SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |                 \
-	 SYNC_FILE_RANGE_WAIT_AFTER)
+/*
+ * Evicting the whole file when it is closed catches the pages brought in by
+ * the I/O paths not hooked by this module, e.g., mmap() and exec(). The sweep
+ * runs in a workqueue in batches of SWEEP_BATCH pages, each starting from the
+ * next cached page, so that neither the latency of close() nor other sweeps
+ * are held up by a large file.
+ *
+ * Unlinked files are not swept because their pages are dropped anyway when
+ * the last reference to the inode goes away.
+ */
+#define SWEEP_BATCH 1024
+
+struct metadata_work;
+static void metadata_queue(struct metadata_work *mw);
+
+struct sweep_work {
+	struct work_struct work;
+	struct inode *inode;
+	struct super_block *sb; /* holds an active reference */
+	pgoff_t index; /* the next page to evict */
+	bool written; /* the dirty pages have been written back */
+	struct metadata_work *mw; /* queued when the sweep is done, or NULL */
+};
 
-#define SYNC_FILE_RANGE_WRITE_AND_WAIT                                         \
-	(SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_BEFORE |                 \
-	 SYNC_FILE_RANGE_WAIT_AFTER)
+static DEFINE_STATIC_KEY_FALSE(evict_on_close_enabled);
 
-int sync_file_range(struct file *file, loff_t offset, loff_t nbytes,
-		    unsigned int flags)
+static int evict_on_close_set(const char *val, const struct kernel_param *kp)
 {
-	int ret;
-	struct address_space *mapping;
-	loff_t endbyte; /* inclusive */
-	umode_t i_mode;
+	return param_set_bool_key(val, kp, &evict_on_close_enabled.key, true);
+}
 
-	ret = -EINVAL;
-	if (flags & ~VALID_FLAGS)
-		goto out;
+static bool evict_on_close;
+static const struct kernel_param_ops evict_on_close_param_ops = {
+	.set = evict_on_close_set,
+	.get = param_get_bool,
+};
+module_param_cb(evict_on_close, &evict_on_close_param_ops, &evict_on_close,
+		0644);
+MODULE_PARM_DESC(evict_on_close,
+		 "Enable/Disable evicting files on close. Default: N.");
 
-	endbyte = offset + nbytes;
+static struct workqueue_struct *sweep_wq;
 
-	if ((s64)offset < 0)
-		goto out;
-	if ((s64)endbyte < 0)
-		goto out;
-	if (endbyte < offset)
+/*
+ * Move *@index to the first page cached at or after it. Return false if
+ * there is none.
+ */
+static bool next_cached_page(struct address_space *mapping, pgoff_t *index)
+{
+	struct page *page;
+	unsigned int nr;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
+	nr = find_get_pages(mapping, *index, 1, &page);
+#else
+	pgoff_t start = *index;
+
+	nr = find_get_pages(mapping, &start, 1, &page);
+#endif
+	if (!nr)
+		return false;
+
+	*index = page_to_pgoff(page);
+	put_page(page);
+	return true;
+}
+
+static void sweep_work_fn(struct work_struct *work)
+{
+	struct sweep_work *sw = container_of(work, struct sweep_work, work);
+	struct address_space *mapping = sw->inode->i_mapping;
+	pgoff_t end;
+
+	/* Dirty pages and pages under write-back cannot be invalidated. */
+	if (!sw->written) {
+		filemap_write_and_wait(mapping);
+		sw->written = true;
+	}
+
+	/*
+	 * Skip the holes in the cache, e.g., of a large block device of which
+	 * only a few pages have been read.
+	 */
+	if (!next_cached_page(mapping, &sw->index))
+		goto done;
+
+	end = sw->index + SWEEP_BATCH - 1;
+	invalidate_mapping_pages(mapping, sw->index, end);
+
+	sw->index = end + 1;
+	if (mapping->nrpages &&
+	    (loff_t)sw->index << PAGE_SHIFT < i_size_read(sw->inode)) {
+		/* Requeue so that other sweeps can make progress. */
+		queue_work(sweep_wq, &sw->work);
+		return;
+	}
+
+done:
+	iput(sw->inode);
+	deactivate_super(sw->sb);
+	if (sw->mw)
+		metadata_queue(sw->mw);
+	kfree(sw);
+}
+
+/*
+ * Sweep the file when it is released. If the sweep is queued, it takes over
+ * *@mw to queue it once the sweep has released the inode.
+ */
+static void sweep_file(struct file *file, struct metadata_work **mw)
+{
+	umode_t i_mode = file_inode(file)->i_mode;
+	struct inode *inode = file->f_mapping->host;
+	struct fscache_device dev;
+	struct sweep_work *sw;
+
+	if (!is_cached_file(i_mode) || !inode->i_nlink ||
+	    !file->f_mapping->nrpages || !lookup_device(file, &dev))
+		return;
+
+	if (static_branch_unlikely(&prewarm_pinned)) {
+		loff_t pin_spos, pin_epos;
+
+		if (prewarm_find_pinned(inode, 0, LLONG_MAX, &pin_spos,
+					&pin_epos))
+			return;
+	}
+
+	sw = kmalloc(sizeof(*sw), GFP_KERNEL);
+	if (!sw)
+		return;
+
+	/*
+	 * A sweep can outlive the mount of the file, so keep the file system
+	 * active until the inode is released, or else umount would find the
+	 * inode busy and free the super block under the sweep.
+	 */
+	if (!atomic_inc_not_zero(&inode->i_sb->s_active)) {
+		kfree(sw);
+		return;
+	}
+
+	INIT_WORK(&sw->work, sweep_work_fn);
+	ihold(inode);
+	sw->inode = inode;
+	sw->sb = inode->i_sb;
+	sw->index = 0;
+	sw->written = false;
+	sw->mw = *mw;
+	*mw = NULL;
+	queue_work(sweep_wq, &sw->work);
+}
+
+/*
+ * The hook runs in __fput() before the file releases its dentry, so the
+ * prune waits for the dentries of the inode to be released, re-checking
+ * every METADATA_RETRY_MS milliseconds up to METADATA_RETRIES times.
+ */
+#define METADATA_RETRIES 10
+#define METADATA_RETRY_MS 10
+
+struct metadata_work {
+	struct delayed_work dwork;
+	struct inode *inode;
+	struct super_block *sb; /* holds an active reference */
+	unsigned int retries;
+};
+
+/* The metadata works not yet done, which the module waits for on exit. */
+static atomic_t metadata_works = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(metadata_wait);
+
+static DEFINE_STATIC_KEY_FALSE(evict_metadata_enabled);
+
+static int evict_metadata_set(const char *val, const struct kernel_param *kp)
+{
+	return param_set_bool_key(val, kp, &evict_metadata_enabled.key, true);
+}
+
+static bool evict_metadata;
+static const struct kernel_param_ops evict_metadata_param_ops = {
+	.set = evict_metadata_set,
+	.get = param_get_bool,
+};
+module_param_cb(evict_metadata, &evict_metadata_param_ops, &evict_metadata,
+		0644);
+MODULE_PARM_DESC(evict_metadata,
+		 "Enable/Disable evicting metadata on close. Default: N.");
+
+static unsigned int metadata_batch = 64;
+module_param(metadata_batch, uint, 0644);
+MODULE_PARM_DESC(metadata_batch,
+		 "Closes between prunes of a file system. Default: 64.");
+
+/* The number of closes of each file system, keyed by s_dev. */
+struct metadata_sb {
+	struct hlist_node hnode; /* in metadata_sbs */
+	dev_t dev;
+	unsigned int closes;
+};
+
+static DEFINE_HASHTABLE(metadata_sbs, 6);
+static DEFINE_MUTEX(metadata_mutex); /* protects metadata_sbs */
+
+/* Count a close on @sb, and return true at every @batch-th one. */
+static bool metadata_count_close(struct super_block *sb, unsigned int batch)
+{
+	struct metadata_sb *ms;
+	bool due = false;
+
+	mutex_lock(&metadata_mutex);
+	hash_for_each_possible(metadata_sbs, ms, hnode, sb->s_dev) {
+		if (ms->dev == sb->s_dev)
+			goto found;
+	}
+
+	ms = kmalloc(sizeof(*ms), GFP_KERNEL);
+	if (!ms)
 		goto out;
+	ms->dev = sb->s_dev;
+	ms->closes = 0;
+	hash_add(metadata_sbs, &ms->hnode, ms->dev);
+
+found:
+	if (++ms->closes >= batch) {
+		ms->closes = 0;
+		due = true;
+	}
+out:
+	mutex_unlock(&metadata_mutex);
+	return due;
+}
 
-	if (sizeof(pgoff_t) == 4) {
-		if (offset >= (0x100000000ULL << PAGE_SHIFT)) {
-			/*
-			 * The range starts outside a 32 bit machine's
-			 * pagecache addressing capabilities.  Let it "succeed"
-			 */
-			ret = 0;
-			goto out;
+static void metadata_free_sbs(void)
+{
+	struct hlist_node *tmp;
+	struct metadata_sb *ms;
+	int bkt;
+
+	hash_for_each_safe(metadata_sbs, bkt, tmp, ms, hnode) {
+		hash_del(&ms->hnode);
+		kfree(ms);
+	}
+}
+
+/*
+ * Prune up to @nr unused dentries and inodes per node from @sb, the same way
+ * as the superblock shrinker does, and drop the clean pages of its device.
+ * See super_cache_scan()
+ * https://elixir.bootlin.com/linux/v5.3.6/source/fs/super.c#L65
+ */
+static void prune_metadata(struct super_block *sb, unsigned long nr)
+{
+	struct shrink_control sc = { .gfp_mask = GFP_KERNEL };
+	int nid;
+
+	/* Do not race with the file system being shut down. */
+	if (!down_read_trylock(&sb->s_umount))
+		return;
+
+	if (sb->s_root && (sb->s_flags & SB_BORN)) {
+		for_each_online_node(nid) {
+			sc.nid = nid;
+			/* Inodes are pinned by their dentries. */
+			sc.nr_to_scan = nr;
+			orig_prune_dcache_sb(sb, &sc);
+			sc.nr_to_scan = nr;
+			orig_prune_icache_sb(sb, &sc);
 		}
-		if (endbyte >= (0x100000000ULL << PAGE_SHIFT)) {
-			/*
-			 * Out to EOF
-			 */
-			nbytes = 0;
+
+		if (sb->s_bdev) {
+			struct address_space *mapping =
+				sb->s_bdev->bd_inode->i_mapping;
+
+			invalidate_mapping_pages(mapping, 0, -1);
 		}
 	}
 
-	if (nbytes == 0)
-		endbyte = LLONG_MAX;
-	else
-		endbyte--; /* inclusive */
+	up_read(&sb->s_umount);
+}
 
-	i_mode = file_inode(file)->i_mode;
-	ret = -ESPIPE;
-	if (!S_ISREG(i_mode) && !S_ISBLK(i_mode) && !S_ISDIR(i_mode) &&
-	    !S_ISLNK(i_mode))
-		goto out;
+/*
+ * Drop @inode, of which the caller holds a reference, from the inode cache
+ * when that is the last reference. Like the inode shrinker, the clean pages
+ * of the inode are dropped only once it is found unused, and the inode is
+ * evicted only if none is left. The prewarmed files are kept.
+ * See inode_lru_isolate()
+ * https://elixir.bootlin.com/linux/v5.3.6/source/fs/inode.c#L717
+ */
+static void evict_inode_if_unused(struct inode *inode)
+{
+	if (static_branch_unlikely(&prewarm_pinned)) {
+		loff_t pin_spos, pin_epos;
 
-	mapping = file->f_mapping;
-	ret = 0;
-	if (flags & SYNC_FILE_RANGE_WAIT_BEFORE) {
-		ret = file_fdatawait_range(file, offset, endbyte);
-		if (ret < 0)
-			goto out;
+		if (prewarm_find_pinned(inode, 0, LLONG_MAX, &pin_spos,
+					&pin_epos))
+			return;
 	}
 
-	if (flags & SYNC_FILE_RANGE_WRITE) {
-		int sync_mode = WB_SYNC_NONE;
+	spin_lock(&inode->i_lock);
+	if (atomic_read(&inode->i_count) != 1 ||
+	    (inode->i_state & ~I_REFERENCED)) {
+		spin_unlock(&inode->i_lock);
+		return;
+	}
 
-		if ((flags & SYNC_FILE_RANGE_WRITE_AND_WAIT) ==
-		    SYNC_FILE_RANGE_WRITE_AND_WAIT)
-			sync_mode = WB_SYNC_ALL;
+	/*
+	 * I_WILL_FREE makes the lookups of the inode wait for it to be
+	 * evicted, so no new reference is taken while its pages are dropped
+	 * and it is unhashed. An unhashed inode is then evicted by the final
+	 * iput() instead of being kept in the LRU list.
+	 * See find_inode() and generic_drop_inode()
+	 */
+	inode->i_state |= I_WILL_FREE;
+	spin_unlock(&inode->i_lock);
 
-		ret = __orig_filemap_fdatawrite_range(mapping, offset, endbyte,
-						      sync_mode);
-		if (ret < 0)
-			goto out;
+	/* Only the clean pages not mapped by any process are dropped. */
+	if (inode->i_data.nrpages)
+		invalidate_mapping_pages(&inode->i_data, 0, -1);
+	if (!inode->i_data.nrpages)
+		remove_inode_hash(inode);
+
+	/*
+	 * Wake up the lookups waiting for the inode if it is kept, the same
+	 * way as evict() does when it is gone.
+	 */
+	spin_lock(&inode->i_lock);
+	inode->i_state &= ~I_WILL_FREE;
+	wake_up_bit(&inode->i_state, __I_NEW);
+	spin_unlock(&inode->i_lock);
+}
+
+/* Return true if a dentry of @inode is still referenced. */
+static bool inode_aliases_busy(struct inode *inode)
+{
+	struct dentry *dentry;
+	bool busy = false;
+
+	spin_lock(&inode->i_lock);
+	hlist_for_each_entry(dentry, &inode->i_dentry, d_u.d_alias) {
+		if (d_count(dentry)) {
+			busy = true;
+			break;
+		}
 	}
+	spin_unlock(&inode->i_lock);
 
-	if (flags & SYNC_FILE_RANGE_WAIT_AFTER)
-		ret = file_fdatawait_range(file, offset, endbyte);
+	return busy;
+}
 
-out:
-	return ret;
+static void metadata_work_fn(struct work_struct *work)
+{
+	struct metadata_work *mw = container_of(to_delayed_work(work),
+						struct metadata_work, dwork);
+	struct inode *inode = mw->inode;
+	unsigned int batch = READ_ONCE(metadata_batch);
+
+	if (inode_aliases_busy(inode) && mw->retries++ < METADATA_RETRIES) {
+		queue_delayed_work(sweep_wq, &mw->dwork,
+				   msecs_to_jiffies(METADATA_RETRY_MS));
+		return;
+	}
+
+	d_prune_aliases(inode);
+	evict_inode_if_unused(inode);
+
+	if (batch && metadata_count_close(mw->sb, batch))
+		prune_metadata(mw->sb, batch);
+
+	iput(inode);
+	deactivate_super(mw->sb);
+	kfree(mw);
+
+	if (atomic_dec_and_test(&metadata_works))
+		wake_up(&metadata_wait);
 }
 
-static inline void async_with_disk(struct file *file, loff_t offset,
-				   ssize_t ret)
+static void metadata_queue(struct metadata_work *mw)
 {
-	umode_t i_mode = file_inode(file)->i_mode;
+	queue_delayed_work(sweep_wq, &mw->dwork, 0);
+}
+
+/*
+ * Return the work to prune the metadata of the file when it is released, to
+ * be passed to metadata_queue(), or NULL.
+ */
+static struct metadata_work *evict_metadata_file(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	struct fscache_device dev;
+	struct metadata_work *mw;
+
+	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode)) ||
+	    !inode->i_nlink || !lookup_device(file, &dev))
+		return NULL;
+
+	mw = kmalloc(sizeof(*mw), GFP_KERNEL);
+	if (!mw)
+		return NULL;
+
+	/* Keep the file system active, see sweep_file(). */
+	if (!atomic_inc_not_zero(&inode->i_sb->s_active)) {
+		kfree(mw);
+		return NULL;
+	}
 
-	if (ret > 0 && S_ISREG(i_mode) && !is_direct(file))
-		/*
-		 * we use this function instead of O_DSYNC to sync
-		 * dirty pages to disk because it does not flush disk
-		 * caches. See the description of ksys_sync_file_range()
-		 * https://elixir.bootlin.com/linux/v5.3.6/source/fs/sync.c#L364
-		 */
-		sync_file_range(file, offset, ret, SYNC_FILE_RANGE_WRITE);
+	INIT_DELAYED_WORK(&mw->dwork, metadata_work_fn);
+	ihold(inode);
+	mw->inode = inode;
+	mw->sb = inode->i_sb;
+	mw->retries = 0;
+	atomic_inc(&metadata_works);
+	return mw;
 }
 
-static asmlinkage long
-no_fscache_sys_write(unsigned int fd, const char __user *buf, size_t count)
+/*
+ * locks_remove_file() is called by __fput() for the last reference to every
+ * opened file, which makes it the place to hook the release of a file.
+ * See https://elixir.bootlin.com/linux/v5.3.6/source/fs/file_table.c#L275
+ */
+static void no_fscache_locks_remove_file(struct file *filp)
 {
-	struct fd f = orig_fdget_pos(fd);
-	ssize_t ret = -EBADF;
+	struct metadata_work *mw = NULL;
 
-	if (f.file) {
-		loff_t pos, *ppos = file_ppos(f.file);
+	orig_locks_remove_file(filp);
 
-		if (ppos) {
-			pos = *ppos;
-			ppos = &pos;
-		}
-		ret = orig_vfs_write(f.file, buf, count, ppos);
-		if (ret >= 0 && ppos) {
-			f.file->f_pos = pos;
-			async_with_disk(f.file, pos - ret, ret);
-		}
-		orig_fdput_pos(f);
-	}
+	if (static_branch_unlikely(&evict_metadata_enabled))
+		mw = evict_metadata_file(filp);
 
-	return ret;
+	/* A sweep holds the inode, so the metadata is pruned after it. */
+	if (static_branch_unlikely(&evict_on_close_enabled))
+		sweep_file(filp, &mw);
+
+	if (static_branch_unlikely(&partial_tracked))
+		partial_release(filp);
+
+	if (mw)
+		metadata_queue(mw);
 }
 
-static ssize_t do_iter_readv_writev(struct file *filp, struct iov_iter *iter,
-				    loff_t *ppos, int type, rwf_t flags)
+/*
+ * Background scanner. As a catch-all for the I/O paths not hooked by this
+ * module, a kernel thread periodically walks the inodes of the file systems
+ * on the affected devices, kicks write-back of the dirty pages and
+ * invalidates the clean pages. The pages it finds tell which I/O paths still
+ * leak into the page cache.
+ */
+#define SCAN_MAX_SUPERS 64
+
+struct scan_stats {
+	u64 passes;
+	u64 inodes; /* inodes found with cached pages */
+	u64 dirty_inodes; /* inodes found with dirty pages */
+	u64 pages; /* pages found cached */
+	u64 invalidated; /* pages invalidated */
+};
+
+static unsigned int scan_interval_ms = 10000;
+module_param(scan_interval_ms, uint, 0644);
+MODULE_PARM_DESC(scan_interval_ms,
+		 "Interval between two scans. Default: 10000.");
+
+static unsigned int scan_pages_per_sec = 262144;
+module_param(scan_pages_per_sec, uint, 0644);
+MODULE_PARM_DESC(scan_pages_per_sec,
+		 "Max pages purged per second (0: no limit). Default: 262144.");
+
+static struct task_struct *scanner_task;
+static DEFINE_MUTEX(scanner_mutex); /* protects scanner_task and scan_cpus */
+static struct cpumask scan_cpus;
+static struct scan_stats scan_stats; /* updated only by the scanner */
+
+struct scan_supers {
+	struct super_block *sbs[SCAN_MAX_SUPERS];
+	int nr;
+};
+
+/* Called by iterate_supers() with sb->s_umount held. */
+static void scan_grab_super(struct super_block *sb, void *arg)
 {
-	struct kiocb kiocb;
-	ssize_t ret;
+	struct scan_supers *supers = arg;
+	struct fscache_device dev;
 
-	init_sync_kiocb(&kiocb, filp);
-	ret = kiocb_set_rw_flags(&kiocb, flags);
-	if (ret)
-		return ret;
-	kiocb.ki_pos = (ppos ? *ppos : 0);
+	if (supers->nr == SCAN_MAX_SUPERS ||
+	    !lookup_bdev_device(sb->s_bdev, &dev))
+		return;
 
-	if (type == READ)
-		ret = call_read_iter(filp, &kiocb, iter);
-	else
-		ret = call_write_iter(filp, &kiocb, iter);
-	BUG_ON(ret == -EIOCBQUEUED);
-	if (ppos)
-		*ppos = kiocb.ki_pos;
-	return ret;
+	/* Hold an active reference so that the scan does not need s_umount. */
+	if (atomic_inc_not_zero(&sb->s_active))
+		supers->sbs[supers->nr++] = sb;
 }
 
-/* Do it by hand, with file-ops */
-static ssize_t do_loop_readv_writev(struct file *filp, struct iov_iter *iter,
-				    loff_t *ppos, int type, rwf_t flags)
+/*
+ * Sleep if the pages purged in the current second exceed the budget.
+ *
+ * Return false if the scanner should stop.
+ */
+static bool scan_throttle(unsigned long *window, unsigned long *budget,
+			  unsigned long pages)
 {
-	ssize_t ret = 0;
+	unsigned int limit = READ_ONCE(scan_pages_per_sec);
 
-	if (flags & ~RWF_HIPRI)
-		return -EOPNOTSUPP;
-
-	while (iov_iter_count(iter)) {
-		struct iovec iovec = iov_iter_iovec(iter);
-		ssize_t nr;
+	if (!limit)
+		return !kthread_should_stop();
 
-		if (type == READ) {
-			nr = filp->f_op->read(filp, iovec.iov_base,
-					      iovec.iov_len, ppos);
-		} else {
-			nr = filp->f_op->write(filp, iovec.iov_base,
-					       iovec.iov_len, ppos);
-		}
+	if (time_after_eq(jiffies, *window + HZ)) {
+		*window = jiffies;
+		*budget = 0;
+	}
 
-		if (nr < 0) {
-			if (!ret)
-				ret = nr;
-			break;
-		}
-		ret += nr;
-		if (nr != iovec.iov_len)
-			break;
-		iov_iter_advance(iter, nr);
+	*budget += pages;
+	if (*budget >= limit) {
+		schedule_timeout_interruptible(*window + HZ - jiffies);
+		*window = jiffies;
+		*budget = 0;
 	}
 
-	return ret;
+	return !kthread_should_stop();
 }
 
-static ssize_t do_iter_write(struct file *file, struct iov_iter *iter,
-			     loff_t *pos, rwf_t flags)
+/* Return the number of pages left in the budget of the current second. */
+static unsigned long scan_budget_left(unsigned long window,
+				      unsigned long budget)
 {
-	size_t tot_len;
-	ssize_t ret = 0;
+	unsigned int limit = READ_ONCE(scan_pages_per_sec);
 
-	if (!(file->f_mode & FMODE_WRITE))
-		return -EBADF;
-	if (!(file->f_mode & FMODE_CAN_WRITE))
-		return -EINVAL;
+	if (!limit)
+		return ULONG_MAX;
 
-	tot_len = iov_iter_count(iter);
-	if (!tot_len)
-		return 0;
-	ret = rw_verify_area(WRITE, file, pos, tot_len);
-	if (ret < 0)
-		return ret;
+	if (time_after_eq(jiffies, window + HZ))
+		return limit;
 
-	if (file->f_op->write_iter)
-		ret = do_iter_readv_writev(file, iter, pos, WRITE, flags);
-	else
-		ret = do_loop_readv_writev(file, iter, pos, WRITE, flags);
-	if (ret > 0)
-		fsnotify_modify(file);
-	return ret;
+	return budget < limit ? limit - budget : 1;
 }
 
-static ssize_t vfs_writev(struct file *file, const struct iovec __user *vec,
-			  unsigned long vlen, loff_t *pos, rwf_t flags)
+/*
+ * Purge the page cache of the inode, in ranges no larger than what is left
+ * in the budget, so that a large file does not purge more pages in a burst
+ * than allowed per second.
+ *
+ * Return false if the scanner should stop.
+ */
+static bool scan_inode(struct inode *inode, unsigned long *window,
+		       unsigned long *budget)
 {
-	struct iovec iovstack[UIO_FASTIOV];
-	struct iovec *iov = iovstack;
-	struct iov_iter iter;
-	ssize_t ret;
-
-	ret = import_iovec(WRITE, vec, vlen, ARRAY_SIZE(iovstack), &iov, &iter);
-	if (ret >= 0) {
-		file_start_write(file);
-		ret = do_iter_write(file, &iter, pos, flags);
-		file_end_write(file);
-		kfree(iov);
+	struct address_space *mapping = inode->i_mapping;
+	unsigned long nrpages = mapping->nrpages;
+	pgoff_t index = 0, last, end;
+	loff_t pin_spos, pin_epos;
+	unsigned long count;
+	bool running = true;
+
+	if (static_branch_unlikely(&prewarm_pinned) &&
+	    prewarm_find_pinned(inode, 0, LLONG_MAX, &pin_spos, &pin_epos))
+		return !kthread_should_stop();
+
+	scan_stats.inodes++;
+	scan_stats.pages += nrpages;
+
+	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY)) {
+		scan_stats.dirty_inodes++;
+		__orig_filemap_fdatawrite_range(mapping, 0, LLONG_MAX,
+						WB_SYNC_NONE);
 	}
-	return ret;
-}
 
-static ssize_t do_writev(unsigned long fd, const struct iovec __user *vec,
-			 unsigned long vlen, rwf_t flags)
-{
-	struct fd f = orig_fdget_pos(fd);
-	ssize_t ret = -EBADF;
+	last = (i_size_read(inode) + ~PAGE_MASK) >> PAGE_SHIFT;
+	while (running && mapping->nrpages && index <= last) {
+		end = min_t(pgoff_t, last,
+			    index + scan_budget_left(*window, *budget) - 1);
+		if (end < index) /* overflow */
+			end = last;
 
-	if (f.file) {
-		loff_t pos, *ppos = file_ppos(f.file);
+		count = invalidate_mapping_pages(mapping, index, end);
+		scan_stats.invalidated += count;
+		running = scan_throttle(window, budget, count);
 
-		if (ppos) {
-			pos = *ppos;
-			ppos = &pos;
-		}
-		ret = vfs_writev(f.file, vec, vlen, ppos, flags);
-		if (ret >= 0 && ppos) {
-			f.file->f_pos = pos;
-			async_with_disk(f.file, pos - ret, ret);
-		}
-		orig_fdput_pos(f);
+		index = end + 1;
+		if (!index) /* wrapped */
+			break;
+		cond_resched();
 	}
 
-	if (ret > 0)
-		add_wchar(current, ret);
-	inc_syscw(current);
-	return ret;
+	return running;
 }
 
-static asmlinkage long no_fscache_sys_writev(unsigned long fd,
-					     const struct iovec __user *vec,
-					     unsigned long vlen)
+/*
+ * Walk the inodes of the super block. This is based on drop_pagecache_sb()
+ * https://elixir.bootlin.com/linux/v5.3.6/source/fs/drop_caches.c#L17
+ *
+ * Return false if the scanner should stop.
+ */
+static bool scan_super(struct super_block *sb, unsigned long *window,
+		       unsigned long *budget)
 {
-	return do_writev(fd, vec, vlen, 0);
+	struct inode *inode, *toput_inode = NULL;
+	bool running = true;
+
+	spin_lock(&sb->s_inode_list_lock);
+	list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
+		spin_lock(&inode->i_lock);
+		if ((inode->i_state & (I_FREEING | I_WILL_FREE | I_NEW)) ||
+		    (inode->i_mapping->nrpages == 0 && !need_resched())) {
+			spin_unlock(&inode->i_lock);
+			continue;
+		}
+		__iget(inode);
+		spin_unlock(&inode->i_lock);
+		spin_unlock(&sb->s_inode_list_lock);
+
+		if (inode->i_mapping->nrpages)
+			running = scan_inode(inode, window, budget);
+		else
+			running = !kthread_should_stop();
+		iput(toput_inode);
+		toput_inode = inode;
+
+		cond_resched();
+		spin_lock(&sb->s_inode_list_lock);
+		if (!running)
+			break;
+	}
+	spin_unlock(&sb->s_inode_list_lock);
+	iput(toput_inode);
+
+	return running;
 }
 
-static asmlinkage long no_fscache_sys_pwrite64(unsigned int fd,
-					       const char __user *buf,
-					       size_t count, loff_t pos)
+static int scanner_fn(void *data)
 {
-	struct fd f;
-	ssize_t ret = -EBADF;
+	unsigned long window = jiffies, budget = 0;
+
+	while (!kthread_should_stop()) {
+		struct scan_supers supers = { .nr = 0 };
+		bool running = true;
+		int i;
+
+		orig_iterate_supers(scan_grab_super, &supers);
+		for (i = 0; i < supers.nr; i++) {
+			if (running)
+				running = scan_super(supers.sbs[i], &window,
+						     &budget);
+			deactivate_super(supers.sbs[i]);
+		}
+		scan_stats.passes++;
 
-	if (pos < 0)
-		return -EINVAL;
+		schedule_timeout_interruptible(
+			msecs_to_jiffies(scan_interval_ms));
+	}
 
-	f = fdget(fd);
-	if (f.file) {
-		ret = -ESPIPE;
-		if (f.file->f_mode & FMODE_PWRITE)
-			ret = orig_vfs_write(f.file, buf, count, &pos);
+	return 0;
+}
 
-		async_with_disk(f.file, pos - ret, ret);
-		fdput(f);
+static bool scanner;
+static bool scanner_ready; /* the symbols needed have been resolved */
+
+/* Start or stop the scanner according to the 'scanner' parameter. */
+static int scanner_update(void)
+{
+	int ret = 0;
+
+	mutex_lock(&scanner_mutex);
+	if (scanner && !scanner_task && scanner_ready) {
+		scanner_task = kthread_create(scanner_fn, NULL,
+					      KBUILD_MODNAME "_scan");
+		if (IS_ERR(scanner_task)) {
+			ret = PTR_ERR(scanner_task);
+			scanner_task = NULL;
+			goto out;
+		}
+		if (!cpumask_empty(&scan_cpus))
+			set_cpus_allowed_ptr(scanner_task, &scan_cpus);
+		wake_up_process(scanner_task);
+	} else if (!scanner && scanner_task) {
+		kthread_stop(scanner_task);
+		scanner_task = NULL;
 	}
 
+out:
+	mutex_unlock(&scanner_mutex);
 	return ret;
 }
 
-static ssize_t do_pwritev(unsigned long fd, const struct iovec __user *vec,
-			  unsigned long vlen, loff_t pos, rwf_t flags)
+static int scanner_set(const char *val, const struct kernel_param *kp)
 {
-	struct fd f;
-	ssize_t ret = -EBADF;
+	int ret = param_set_bool(val, kp);
 
-	if (pos < 0)
-		return -EINVAL;
+	if (ret)
+		return ret;
 
-	f = fdget(fd);
-	if (f.file) {
-		ret = -ESPIPE;
-		if (f.file->f_mode & FMODE_PWRITE)
-			ret = vfs_writev(f.file, vec, vlen, &pos, flags);
+	return scanner_update();
+}
 
-		async_with_disk(f.file, pos - ret, ret);
-		fdput(f);
+static const struct kernel_param_ops scanner_param_ops = {
+	.set = scanner_set,
+	.get = param_get_bool,
+};
+module_param_cb(scanner, &scanner_param_ops, &scanner, 0644);
+MODULE_PARM_DESC(scanner,
+		 "Enable/Disable the background scanner. Default: N.");
+
+static int scan_cpus_set(const char *val, const struct kernel_param *kp)
+{
+	cpumask_var_t mask;
+	char *list;
+	int ret;
+
+	list = kstrdup(val, GFP_KERNEL);
+	if (!list)
+		return -ENOMEM;
+
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL)) {
+		kfree(list);
+		return -ENOMEM;
 	}
 
-	if (ret > 0)
-		add_wchar(current, ret);
-	inc_syscw(current);
-	return ret;
-}
+	ret = cpulist_parse(strim(list), mask);
+	if (ret)
+		goto out;
 
-static asmlinkage long no_fscache_sys_pwritev(unsigned long fd,
-					      const struct iovec __user *vec,
-					      unsigned long vlen,
-					      unsigned long pos_l,
-					      unsigned long pos_h)
-{
-	loff_t pos = pos_from_hilo(pos_h, pos_l);
+	mutex_lock(&scanner_mutex);
+	cpumask_copy(&scan_cpus, mask);
+	if (scanner_task)
+		ret = set_cpus_allowed_ptr(scanner_task,
+					   cpumask_empty(mask) ?
+						   cpu_possible_mask :
+						   mask);
+	mutex_unlock(&scanner_mutex);
 
-	return do_pwritev(fd, vec, vlen, pos, 0);
+out:
+	free_cpumask_var(mask);
+	kfree(list);
+	return ret;
 }
 
-static asmlinkage long no_fscache_sys_pwritev2(unsigned long fd,
-					       const struct iovec __user *vec,
-					       unsigned long vlen,
-					       unsigned long pos_l,
-					       unsigned long pos_h, rwf_t flags)
+static int scan_cpus_get(char *buffer, const struct kernel_param *kp)
 {
-	loff_t pos = pos_from_hilo(pos_h, pos_l);
+	return sprintf(buffer, "%*pbl\n", cpumask_pr_args(&scan_cpus));
+}
 
-	if (pos == -1)
-		return do_writev(fd, vec, vlen, flags);
+static const struct kernel_param_ops scan_cpus_param_ops = {
+	.set = scan_cpus_set,
+	.get = scan_cpus_get,
+};
+module_param_cb(scan_cpus, &scan_cpus_param_ops, NULL, 0644);
+MODULE_PARM_DESC(scan_cpus,
+		 "CPUs to run the scanner on. Default: \"\" (all).");
 
-	return do_pwritev(fd, vec, vlen, pos, flags);
+static int scanner_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "passes %llu\n", READ_ONCE(scan_stats.passes));
+	seq_printf(m, "inodes %llu\n", READ_ONCE(scan_stats.inodes));
+	seq_printf(m, "dirty_inodes %llu\n",
+		   READ_ONCE(scan_stats.dirty_inodes));
+	seq_printf(m, "pages %llu\n", READ_ONCE(scan_stats.pages));
+	seq_printf(m, "invalidated %llu\n", READ_ONCE(scan_stats.invalidated));
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(scanner);
 
 struct func_symbol {
 	const char *name;
@@ -883,6 +4248,12 @@ static struct func_symbol dept_fsyms[] = {
 	FUNC_SYMBOL("do_sys_open", &orig_do_sys_open, 1),
 	FUNC_SYMBOL("__filemap_fdatawrite_range",
 		    &__orig_filemap_fdatawrite_range, 0),
+	FUNC_SYMBOL("force_page_cache_readahead",
+		    &orig_force_page_cache_readahead, 0),
+	FUNC_SYMBOL("locks_remove_file", &orig_locks_remove_file, 1),
+	FUNC_SYMBOL("iterate_supers", &orig_iterate_supers, 0),
+	FUNC_SYMBOL("prune_dcache_sb", &orig_prune_dcache_sb, 0),
+	FUNC_SYMBOL("prune_icache_sb", &orig_prune_icache_sb, 0),
 };
 
 static int fill_func_symbol(struct func_symbol *fsym)
@@ -935,6 +4306,7 @@ static struct klp_func funcs[] = {
 	KLP_FUNC("sys_preadv2", no_fscache_sys_preadv2),
 	KLP_FUNC("sys_pwritev2", no_fscache_sys_pwritev2),
 	KLP_FUNC("do_sys_open", no_fscache_do_sys_open),
+	KLP_FUNC("locks_remove_file", no_fscache_locks_remove_file),
 	{}
 };
 
@@ -951,30 +4323,110 @@ static struct klp_patch patch = {
 	.objs = objs,
 };
 
+static struct dentry *debugfs_root;
+
+/*
+ * Stop the work started and free the objects allocated by the parameter
+ * setters, which may have run at insmod time before no_fscache_init().
+ */
+static void free_param_state(void)
+{
+	WRITE_ONCE(evict_policy, EVICT_ALWAYS);
+	cancel_delayed_work_sync(&pressure_work);
+
+	deferred = false;
+	evict_workers_update();
+
+	kfree(rcu_dereference_protected(device_table, 1));
+	mrc_free_trackers();
+	evict_free_queues();
+	iotrace_free_buffers();
+}
+
 static int no_fscache_init(void)
 {
 	int ret;
 
+	evict_nodes_init();
+
 	ret = resolve_func();
 	if (ret)
-		return ret;
+		goto err_params;
+
+	prewarm_wq = alloc_workqueue(KBUILD_MODNAME "_prewarm", WQ_UNBOUND, 0);
+	if (!prewarm_wq) {
+		ret = -ENOMEM;
+		goto err_params;
+	}
+
+	sweep_wq = alloc_workqueue(KBUILD_MODNAME "_sweep", WQ_UNBOUND, 0);
+	if (!sweep_wq) {
+		ret = -ENOMEM;
+		goto err_prewarm_wq;
+	}
+
+	debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("mrc", 0444, debugfs_root, NULL, &mrc_fops);
+	debugfs_create_file("prewarm", 0644, debugfs_root, NULL,
+			    &prewarm_fops);
+	debugfs_create_file("scanner", 0444, debugfs_root, NULL,
+			    &scanner_fops);
+	debugfs_create_file("deferred", 0444, debugfs_root, NULL,
+			    &deferred_fops);
+	iotrace_create_files(debugfs_root);
 
 	ret = klp_register_patch(&patch);
 	if (ret)
-		return ret;
+		goto err_debugfs;
 
 	ret = klp_enable_patch(&patch);
 	if (ret) {
 		WARN_ON(klp_unregister_patch(&patch));
-		return ret;
+		goto err_debugfs;
 	}
 
+	/*
+	 * Start the scanner and the deferred workers if they are enabled when
+	 * the module is inserted.
+	 */
+	scanner_ready = true;
+	scanner_update();
+	evict_workers_ready = true;
+	evict_workers_update();
+
 	return 0;
+
+err_debugfs:
+	debugfs_remove_recursive(debugfs_root);
+	destroy_workqueue(sweep_wq);
+err_prewarm_wq:
+	destroy_workqueue(prewarm_wq);
+err_params:
+	free_param_state();
+	return ret;
 }
 
 static void no_fscache_exit(void)
 {
 	WARN_ON(klp_unregister_patch(&patch));
+
+	scanner = false;
+	scanner_update();
+
+	debugfs_remove_recursive(debugfs_root);
+
+	prewarm_clear();
+	destroy_workqueue(prewarm_wq);
+	/*
+	 * A metadata work may be waiting on a timer, or for a sweep, which
+	 * destroy_workqueue() does not wait for.
+	 */
+	wait_event(metadata_wait, !atomic_read(&metadata_works));
+	/* This waits for the pending sweeps to release the inodes. */
+	destroy_workqueue(sweep_wq);
+	metadata_free_sbs();
+	partial_free_all();
+	free_param_state();
 }
 
 module_init(no_fscache_init);
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: BSD-3-Clause OR GPL-2.0 */
+// Copyright (c) 2019, Jianshen Liu <jliu120@ucsc.edu>
+
+/*
+ * Layout of the I/O trace shared between module no_fscache and the userspace
+ * tools in tools/trace.
+ *
+ * Each CPU has its own ring buffer exposed as
+ * /sys/kernel/debug/no_fscache/trace/cpu<N>. Mapping the file gives a header
+ * at offset 0 followed by an array of nr_records records at data_offset. The
+ * module is the only producer of a ring buffer and advances head after a
+ * record is written. The consumer advances tail after a record is read. Both
+ * counters only increase, and the record of counter c is at index
+ * c & (nr_records - 1). A record is dropped if the ring buffer is full.
+ */
+
+#ifndef _NO_FSCACHE_TRACE_H
+#define _NO_FSCACHE_TRACE_H
+
+#include <linux/types.h>
+
+#define NOFSCACHE_TRACE_MAGIC 0x4e4f4653 /* "NOFS" */
+
+enum nofscache_trace_op {
+	NOFSCACHE_TRACE_READ,
+	NOFSCACHE_TRACE_WRITE,
+};
+
+struct nofscache_trace_header {
+	__u32 magic;
+	__u32 record_size;
+	__u32 nr_records; /* power of 2 */
+	__u32 data_offset;
+	__u64 head; /* written by the producer */
+	__u64 tail; /* written by the consumer */
+	__u64 dropped; /* records dropped because the buffer is full */
+};
+
+struct nofscache_trace_record {
+	__u64 timestamp; /* CLOCK_MONOTONIC in ns at the start of the I/O */
+	__u64 ino;
+	__u64 offset;
+	__u32 dev; /* new_encode_dev() of the device of the file */
+	__u32 pid;
+	__u32 len;
+	__u32 latency; /* in ns, including the eviction and write-back */
+	__u32 evicted; /* number of pages evicted */
+	__u8 op; /* enum nofscache_trace_op */
+	__u8 pad[3];
+};
+
+#endif /* _NO_FSCACHE_TRACE_H */
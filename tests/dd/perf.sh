@@ -5,8 +5,9 @@ set -eu -o pipefail
 SCRIPT_NAME="$(basename "${BASH_SOURCE[0]}")"
 
 usage() {
-  printf "Usage: ./%s <r|w> [DD_OPTIONS]
+  printf "Usage: ./%s <r|w> DEVICE [DD_OPTIONS]
 <r|w>\\t\\t: Test dd read or dd write.
+DEVICE\\t\\t: The storage device (e.g., sda) that stores the current dir.
 DD_OPTIONS\\t: See DD(1) for all DD options.
 
 This script requires a FLAMEGRAPH_SRC variable to point to the repository of FlameGraph.
@@ -20,7 +21,7 @@ if [[ $EUID -ne 0 ]]; then
   exit 1
 fi
 
-if [[ "$#" -lt 1 ]]; then
+if [[ "$#" -lt 2 ]]; then
   usage
   exit 1
 fi
@@ -34,8 +35,10 @@ if [[ "$ops" != "r" && "$ops" != "w" ]]; then
   exit 1
 fi
 
-# remove the 1st parameter
-set -- "${@:2}"
+device="$2"
+
+# remove the first two parameters
+set -- "${@:3}"
 
 if [[ -z "${FLAMEGRAPH_SRC:-}" ]]; then
   printf >&2 "[Error] Please set the FLAMEGRAPH_SRC variable before running this script.\\n\\n"
@@ -43,10 +46,21 @@ if [[ -z "${FLAMEGRAPH_SRC:-}" ]]; then
   exit 2
 fi
 
+MOD_PARAMS=/sys/module/no_fscache/parameters
+
+if [[ ! -d "$MOD_PARAMS" ]]; then
+  printf >&2 "[Error] Module no_fscache is not loaded.\\n\\n"
+  exit 2
+fi
+
+orig_devices="$(cat "$MOD_PARAMS"/no_fscache_device)"
+echo "$device" > "$MOD_PARAMS"/no_fscache_device
+
 tmpfile="$(mktemp --dry-run "$PWD"/perf_dd.data.XXXXXXXXXX)"
 
 die() {
   rm -f "$tmpfile"
+  echo "$orig_devices" > "$MOD_PARAMS"/no_fscache_device
 }
 trap die EXIT
 
@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+
+set -eu -o pipefail
+
+SCRIPT_NAME="$(basename "${BASH_SOURCE[0]}")"
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+
+MOD_PARAMS=/sys/module/no_fscache/parameters
+DEFERRED_STATS=/sys/kernel/debug/no_fscache/deferred
+
+usage() {
+  printf "Usage: ./%s DEVICE [FIO_JOB_FILE]
+DEVICE\\t\\t: The storage device (e.g., nvme0n1) that stores the fio data files.
+FIO_JOB_FILE\\t: The fio job file to run. Default: %s
+
+Run the fio job with eviction and write-back done in the system calls, and
+then deferred to the NUMA-local workers of module no_fscache, so that the
+cost of cross-node eviction can be compared. The default job runs one group
+of jobs bound to each of NUMA node 0 and 1, which needs a fio built with
+libnuma. Run this script in a directory on DEVICE. The fio output of each run
+is saved to fio_inline.out and fio_deferred.out in the current dir, and the
+per-node counters of the deferred run to deferred.out.
+" "$SCRIPT_NAME" "$SCRIPT_DIR/jobs/fio-numa-RW.fio"
+}
+
+if [[ $EUID -ne 0 ]]; then
+  printf >&2 "[Error] This script must be run as root.\\n\\n"
+  usage
+  exit 1
+fi
+
+if [[ "$#" -lt 1 ]]; then
+  usage
+  exit 1
+fi
+
+device="$1"
+job_file="${2:-$SCRIPT_DIR/jobs/fio-numa-RW.fio}"
+
+if [[ ! -d "$MOD_PARAMS" ]]; then
+  printf >&2 "[Error] Module no_fscache is not loaded.\\n\\n"
+  exit 2
+fi
+
+orig_devices="$(cat "$MOD_PARAMS"/no_fscache_device)"
+orig_deferred="$(cat "$MOD_PARAMS"/deferred)"
+
+restore() {
+  echo "$orig_devices" > "$MOD_PARAMS"/no_fscache_device
+  echo "$orig_deferred" > "$MOD_PARAMS"/deferred
+}
+trap restore EXIT
+
+echo "$device" > "$MOD_PARAMS"/no_fscache_device
+
+for run in inline deferred; do
+  echo "[INFO] Running fio with $run eviction on device $device..."
+  if [[ "$run" == deferred ]]; then
+    echo 1 > "$MOD_PARAMS"/deferred
+    cp "$DEFERRED_STATS" deferred.before
+  else
+    echo 0 > "$MOD_PARAMS"/deferred
+  fi
+
+  sync
+  echo 3 > /proc/sys/vm/drop_caches
+
+  fio --output=fio_"$run".out "$job_file"
+done
+
+cat "$DEFERRED_STATS" > deferred.out
+
+echo
+for run in inline deferred; do
+  printf "[INFO] %s eviction:\\n" "$run"
+  grep -E '^ +(READ|read|WRITE|write):' fio_"$run".out || true
+  echo
+done
+
+printf "[INFO] Deferred works per node (before and after the deferred run):\\n"
+cat deferred.before deferred.out
@@ -0,0 +1,64 @@
+#!/usr/bin/env bash
+
+set -eu -o pipefail
+
+SCRIPT_NAME="$(basename "${BASH_SOURCE[0]}")"
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+
+MOD_PARAMS=/sys/module/no_fscache/parameters
+WRITE_MODES=(start wait sync)
+
+usage() {
+  printf "Usage: ./%s DEVICE [FIO_JOB_FILE]
+DEVICE\\t\\t: The storage device (e.g., sda) that stores the fio data file.
+FIO_JOB_FILE\\t: The fio job file to run. Default: %s
+
+Run the fio job once for each write mode (%s) of module no_fscache on the
+same device so that the cost of each durability level can be compared.
+Run this script in a directory on DEVICE. The fio output of each mode is
+saved to fio_<mode>.out in the current dir.
+" "$SCRIPT_NAME" "$SCRIPT_DIR/jobs/fio-seq-write.fio" "${WRITE_MODES[*]}"
+}
+
+if [[ $EUID -ne 0 ]]; then
+  printf >&2 "[Error] This script must be run as root.\\n\\n"
+  usage
+  exit 1
+fi
+
+if [[ "$#" -lt 1 ]]; then
+  usage
+  exit 1
+fi
+
+device="$1"
+job_file="${2:-$SCRIPT_DIR/jobs/fio-seq-write.fio}"
+
+if [[ ! -d "$MOD_PARAMS" ]]; then
+  printf >&2 "[Error] Module no_fscache is not loaded.\\n\\n"
+  exit 2
+fi
+
+orig_devices="$(cat "$MOD_PARAMS"/no_fscache_device)"
+
+restore() {
+  echo "$orig_devices" > "$MOD_PARAMS"/no_fscache_device
+}
+trap restore EXIT
+
+for mode in "${WRITE_MODES[@]}"; do
+  echo "[INFO] Running fio with write mode '$mode' on device $device..."
+  echo "$device:$mode" > "$MOD_PARAMS"/no_fscache_device
+
+  sync
+  echo 3 > /proc/sys/vm/drop_caches
+
+  fio --output=fio_"$mode".out "$job_file"
+done
+
+echo
+for mode in "${WRITE_MODES[@]}"; do
+  printf "[INFO] Write mode '%s':\\n" "$mode"
+  grep -E '^ +(WRITE|write):|^ +clat \(' fio_"$mode".out || true
+  echo
+done
@@ -0,0 +1,90 @@
+#!/usr/bin/env bash
+
+set -eu -o pipefail
+
+SCRIPT_NAME="$(basename "${BASH_SOURCE[0]}")"
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+
+MOD_PARAMS=/sys/module/no_fscache/parameters
+
+usage() {
+  printf "Usage: ./%s DEVICE [BLOCK_SIZE_KiB] [SECONDS]
+DEVICE\\t\\t: The storage device (e.g., sda) that stores the current dir.
+BLOCK_SIZE_KiB\\t: The size of each write. Default: 4
+SECONDS\\t\\t: The duration of each test. Default: 30
+
+Run shared_fd_write with an increasing number of threads appending to a file
+in the current dir through a single shared file descriptor, once with DEVICE
+not affected by module no_fscache (off) and once with it affected (on), and
+compare the throughput. Since write-back is started after f_pos_lock is
+released, the 'on' throughput should scale with the threads like 'off' does.
+" "$SCRIPT_NAME"
+}
+
+if [[ $EUID -ne 0 ]]; then
+  printf >&2 "[Error] This script must be run as root.\\n\\n"
+  usage
+  exit 1
+fi
+
+if [[ "$#" -lt 1 || "$#" -gt 3 ]]; then
+  usage
+  exit 1
+fi
+
+device="$1"
+bs="${2:-4}"
+secs="${3:-30}"
+
+if [[ ! -d "$MOD_PARAMS" ]]; then
+  printf >&2 "[Error] Module no_fscache is not loaded.\\n\\n"
+  exit 2
+fi
+
+prog="$SCRIPT_DIR"/shared_fd_write
+if [[ ! -x "$prog" ]]; then
+  echo "[INFO] Building $prog..."
+  gcc -O2 -Wall -pthread -o "$prog" "$SCRIPT_DIR"/shared_fd_write.c
+fi
+
+orig_devices="$(cat "$MOD_PARAMS"/no_fscache_device)"
+tmpfile="$(mktemp --dry-run "$PWD"/shared_fd.data.XXXXXXXXXX)"
+
+die() {
+  rm -f "$tmpfile"
+  echo "$orig_devices" > "$MOD_PARAMS"/no_fscache_device
+}
+trap die EXIT
+
+declare -A bw
+
+for mode in off on; do
+  if [[ "$mode" == on ]]; then
+    echo "$device" > "$MOD_PARAMS"/no_fscache_device
+  else
+    echo '' > "$MOD_PARAMS"/no_fscache_device
+  fi
+
+  for nthreads in 1 2 4 8 16 32; do
+    [[ "$nthreads" -gt "$(nproc)" ]] && break
+
+    rm -f "$tmpfile"
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+
+    echo "[INFO] Running with module $mode for device $device, $nthreads threads..."
+    out="$("$prog" "$tmpfile" "$nthreads" "$bs" "$secs")"
+    echo "$out"
+    bw["$mode,$nthreads"]="$(sed -n 's/.* bw=\([0-9.]*\)MiB\/s$/\1/p' <<< "$out")"
+  done
+done
+
+echo
+printf "%-8s %14s %14s %8s\\n" threads "off (MiB/s)" "on (MiB/s)" "on/off"
+for nthreads in 1 2 4 8 16 32; do
+  [[ -z "${bw[on,$nthreads]:-}" ]] && break
+  printf "%-8s %14s %14s %8s\\n" "$nthreads" "${bw[off,$nthreads]}" \
+    "${bw[on,$nthreads]}" \
+    "$(awk -v on="${bw[on,$nthreads]}" -v off="${bw[off,$nthreads]}" \
+      'BEGIN { if (off > 0) printf "%.2f", on / off; else print "-" }')"
+done
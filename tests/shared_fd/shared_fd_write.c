@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: BSD-3-Clause OR GPL-2.0
+// Copyright (c) 2019, Jianshen Liu <jliu120@ucsc.edu>
+
+/*
+ * Append to a file from multiple threads through a single shared file
+ * descriptor and report the aggregated write throughput.
+ *
+ * Since all threads share the same struct file, each write(2) holds
+ * f_pos_lock while updating the file offset. This program shows how well
+ * the write path of module no_fscache scales with the number of threads.
+ *
+ * Build:
+ *	gcc -O2 -Wall -pthread -o shared_fd_write shared_fd_write.c
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int fd;
+static size_t block_size;
+static volatile int stop;
+
+static void *writer(void *arg)
+{
+	unsigned long long *bytes = arg;
+	char *buf = malloc(block_size);
+
+	if (!buf) {
+		perror("malloc");
+		return NULL;
+	}
+	memset(buf, 'a', block_size);
+
+	while (!stop) {
+		ssize_t ret = write(fd, buf, block_size);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			break;
+		}
+		*bytes += ret;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s FILE NUM_THREADS [BLOCK_SIZE_KiB] [SECONDS]\n"
+		"FILE\t\t: The file to append to. It is truncated first.\n"
+		"NUM_THREADS\t: The number of threads sharing the fd.\n"
+		"BLOCK_SIZE_KiB\t: The size of each write. Default: 4\n"
+		"SECONDS\t\t: The duration of the test. Default: 30\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long *bytes, total = 0;
+	struct timespec start, end;
+	pthread_t *threads;
+	unsigned int seconds = 30;
+	int nthreads, i;
+	double elapsed;
+
+	if (argc < 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	nthreads = atoi(argv[2]);
+	block_size = (argc > 3 ? strtoul(argv[3], NULL, 10) : 4) * 1024;
+	if (argc > 4)
+		seconds = strtoul(argv[4], NULL, 10);
+	if (nthreads <= 0 || !block_size || !seconds) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0) {
+		perror("open");
+		return 2;
+	}
+
+	threads = calloc(nthreads, sizeof(*threads));
+	bytes = calloc(nthreads, sizeof(*bytes));
+	if (!threads || !bytes) {
+		perror("calloc");
+		return 2;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, writer, &bytes[i])) {
+			fprintf(stderr, "failed to create thread %d\n", i);
+			return 3;
+		}
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		total += bytes[i];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("threads=%d bs=%zuKiB bytes=%llu time=%.2fs bw=%.2fMiB/s\n",
+	       nthreads, block_size / 1024, total, elapsed,
+	       total / elapsed / (1024 * 1024));
+
+	close(fd);
+	free(bytes);
+	free(threads);
+	return 0;
+}
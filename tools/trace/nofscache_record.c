@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: BSD-3-Clause OR GPL-2.0
+// Copyright (c) 2019, Jianshen Liu <jliu120@ucsc.edu>
+
+/*
+ * Drain the per-CPU I/O trace buffers of module no_fscache into a trace file.
+ *
+ * The buffers are mapped from /sys/kernel/debug/no_fscache/trace/cpu<N> and
+ * consumed in place without copying them through read(2). The trace file is
+ * a plain array of struct nofscache_trace_record. Records of different CPUs
+ * are not sorted by time; nofscache_replay sorts them before replaying.
+ *
+ * Enable tracing before running this program
+ *	echo 1 > /sys/module/no_fscache/parameters/iotrace
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../../no_fscache_trace.h"
+
+#define TRACE_DIR "/sys/kernel/debug/no_fscache/trace"
+
+struct cpu_buffer {
+	struct nofscache_trace_header *hdr;
+	struct nofscache_trace_record *records;
+	size_t size;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int map_buffer(int cpu, struct cpu_buffer *buf)
+{
+	struct nofscache_trace_header *hdr;
+	long page_size = sysconf(_SC_PAGESIZE);
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof(path), TRACE_DIR "/cpu%d", cpu);
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return -errno;
+
+	/* Map the header first to find out the size of the buffer. */
+	hdr = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		close(fd);
+		return -errno;
+	}
+	if (hdr->magic != NOFSCACHE_TRACE_MAGIC ||
+	    hdr->record_size != sizeof(struct nofscache_trace_record)) {
+		fprintf(stderr, "%s: unknown trace format\n", path);
+		munmap(hdr, page_size);
+		close(fd);
+		return -EINVAL;
+	}
+	buf->size = hdr->data_offset +
+		    (size_t)hdr->nr_records * hdr->record_size;
+	munmap(hdr, page_size);
+
+	buf->hdr = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	close(fd);
+	if (buf->hdr == MAP_FAILED)
+		return -errno;
+
+	buf->records = (void *)buf->hdr + buf->hdr->data_offset;
+	return 0;
+}
+
+/* Write the available records of the buffer to out. */
+static size_t drain(struct cpu_buffer *buf, FILE *out)
+{
+	__u64 head = __atomic_load_n(&buf->hdr->head, __ATOMIC_ACQUIRE);
+	__u64 tail = buf->hdr->tail;
+	__u32 mask = buf->hdr->nr_records - 1;
+	size_t n = 0;
+
+	for (; tail != head; tail++, n++)
+		fwrite(&buf->records[tail & mask], sizeof(*buf->records), 1,
+		       out);
+
+	/* Release the slots only after the records are copied. */
+	__atomic_store_n(&buf->hdr->tail, tail, __ATOMIC_RELEASE);
+	return n;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s OUTPUT [INTERVAL_MS]\n"
+		"OUTPUT\t\t: The trace file to write.\n"
+		"INTERVAL_MS\t: How often to drain the buffers. Default: 100\n"
+		"\n"
+		"Record until interrupted by SIGINT or SIGTERM.\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	unsigned int interval_ms = 100;
+	unsigned long long total = 0;
+	struct cpu_buffer *bufs;
+	int nbufs = 0, cpu;
+	FILE *out;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		interval_ms = strtoul(argv[2], NULL, 10);
+
+	bufs = calloc(ncpus, sizeof(*bufs));
+	if (!bufs) {
+		perror("calloc");
+		return 2;
+	}
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		int ret = map_buffer(cpu, &bufs[cpu]);
+
+		if (ret == -ENOENT)
+			continue;
+		if (ret) {
+			fprintf(stderr, "failed to map the buffer of cpu%d: %s\n",
+				cpu, strerror(-ret));
+			return 2;
+		}
+		nbufs++;
+	}
+	if (!nbufs) {
+		fprintf(stderr, "no trace buffer found in %s\n", TRACE_DIR);
+		return 2;
+	}
+
+	out = fopen(argv[1], "w");
+	if (!out) {
+		perror("fopen");
+		return 2;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	while (!stop) {
+		for (cpu = 0; cpu < ncpus; cpu++)
+			if (bufs[cpu].hdr)
+				total += drain(&bufs[cpu], out);
+		usleep(interval_ms * 1000);
+	}
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		if (!bufs[cpu].hdr)
+			continue;
+		total += drain(&bufs[cpu], out);
+		if (bufs[cpu].hdr->dropped)
+			fprintf(stderr, "cpu%d: %llu records dropped\n", cpu,
+				(unsigned long long)bufs[cpu].hdr->dropped);
+		munmap(bufs[cpu].hdr, bufs[cpu].size);
+	}
+
+	fclose(out);
+	free(bufs);
+	printf("%llu records written to %s\n", total, argv[1]);
+	return 0;
+}
@@ -0,0 +1,598 @@
+// SPDX-License-Identifier: BSD-3-Clause OR GPL-2.0
+// Copyright (c) 2019, Jianshen Liu <jliu120@ucsc.edu>
+
+/*
+ * Replay an I/O trace recorded by nofscache_record with io_uring, or with a
+ * pool of threads calling pread()/pwrite() on kernels without io_uring (before
+ * v5.1), which include all the kernels the module can be loaded on.
+ *
+ * Every file (device and inode) in the trace is replayed against its own
+ * file in a test directory, which is created and filled up to the largest
+ * offset the trace reads from. Each I/O is issued at its original time
+ * divided by a speed factor, so the original inter-arrival pattern is kept
+ * at a scaled rate. A speed factor of 0 replays as fast as the queue depth
+ * allows.
+ *
+ * io_uring is driven by the raw system calls so that liburing is not needed,
+ * and is only built if the UAPI headers have it.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#include "../../no_fscache_trace.h"
+
+#ifdef HAVE_IO_URING
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#endif
+
+#define FILL_CHUNK (1 << 20)
+
+struct slot {
+	struct iovec iov;
+	size_t buf_size;
+	unsigned long long issued;
+	int fd;
+	int write;
+	long long res; /* the result of the I/O, set by the thread engine */
+	int busy;
+};
+
+/*
+ * An I/O engine. Completions are identified by the index of the slot of the
+ * I/O.
+ */
+struct engine {
+	const char *name;
+	int (*submit)(struct slot *slots, unsigned int index, __u64 offset);
+	/* Get a completed I/O, return 0 if there is none. */
+	int (*reap)(struct slot *slots, unsigned int *index, long long *res);
+	/* Wait for a completion until @deadline of now_ns(), forever if 0. */
+	void (*wait)(unsigned long long deadline);
+};
+
+struct test_file {
+	__u32 dev;
+	__u64 ino;
+	__u64 size; /* the largest offset read from */
+	int fd;
+};
+
+static struct test_file *files;
+static size_t nfiles;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifdef HAVE_IO_URING
+struct uring {
+	int fd;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+
+static struct uring ring = { .fd = -1 };
+
+static int uring_setup(unsigned int entries)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	void *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring.fd < 0)
+		return -errno;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -errno;
+	cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+		return -errno;
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		return -errno;
+
+	ring.sq_tail = sq + p.sq_off.tail;
+	ring.sq_mask = sq + p.sq_off.ring_mask;
+	ring.sq_array = sq + p.sq_off.array;
+	ring.cq_head = cq + p.cq_off.head;
+	ring.cq_tail = cq + p.cq_off.tail;
+	ring.cq_mask = cq + p.cq_off.ring_mask;
+	ring.cqes = cq + p.cq_off.cqes;
+	return 0;
+}
+
+static int uring_submit(struct slot *slots, unsigned int index, __u64 offset)
+{
+	unsigned int tail = *ring.sq_tail;
+	unsigned int sq_index = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[sq_index];
+	struct slot *s = &slots[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = s->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = s->fd;
+	sqe->off = offset;
+	sqe->addr = (unsigned long)&s->iov;
+	sqe->len = 1;
+	sqe->user_data = index;
+	ring.sq_array[sq_index] = sq_index;
+
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) < 0)
+		return -errno;
+	return 0;
+}
+
+static int uring_reap(struct slot *slots, unsigned int *index, long long *res)
+{
+	unsigned int head = *ring.cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	cqe = &ring.cqes[head & *ring.cq_mask];
+	*index = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* The ring is readable when it has completions. */
+static void uring_wait(unsigned long long deadline)
+{
+	struct pollfd pfd = { .fd = ring.fd, .events = POLLIN };
+	struct timespec ts, *timeout = NULL;
+	unsigned long long now = now_ns();
+
+	if (deadline) {
+		if (deadline <= now)
+			return;
+		ts.tv_sec = (deadline - now) / 1000000000ULL;
+		ts.tv_nsec = (deadline - now) % 1000000000ULL;
+		timeout = &ts;
+	}
+
+	ppoll(&pfd, 1, timeout, NULL);
+}
+
+static const struct engine uring_engine = {
+	.name = "io_uring",
+	.submit = uring_submit,
+	.reap = uring_reap,
+	.wait = uring_wait,
+};
+#endif /* HAVE_IO_URING */
+
+/*
+ * The engine for kernels without io_uring: a pool of threads, one for each
+ * I/O in flight, running the I/Os queued to it with pread()/pwrite().
+ */
+struct thread_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t submitted, completed;
+	struct slot *slots;
+	unsigned int depth;
+	unsigned int *sq, sq_head, sq_tail; /* slots to run */
+	unsigned int *cq, cq_head, cq_tail; /* slots done */
+	__u64 *offsets; /* indexed by slot */
+};
+
+static struct thread_pool pool;
+
+static void *pool_worker(void *arg)
+{
+	unsigned int index;
+	struct slot *s;
+	long long res;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.sq_head == pool.sq_tail)
+			pthread_cond_wait(&pool.submitted, &pool.lock);
+		index = pool.sq[pool.sq_head++ % pool.depth];
+		pthread_mutex_unlock(&pool.lock);
+
+		s = &pool.slots[index];
+		if (s->write)
+			res = pwrite(s->fd, s->iov.iov_base, s->iov.iov_len,
+				     pool.offsets[index]);
+		else
+			res = pread(s->fd, s->iov.iov_base, s->iov.iov_len,
+				    pool.offsets[index]);
+		s->res = res < 0 ? -errno : res;
+
+		pthread_mutex_lock(&pool.lock);
+		pool.cq[pool.cq_tail++ % pool.depth] = index;
+		pthread_cond_signal(&pool.completed);
+	}
+
+	return NULL;
+}
+
+static int pool_setup(struct slot *slots, unsigned int depth)
+{
+	pthread_condattr_t attr;
+	pthread_t thread;
+	unsigned int i;
+
+	pool.slots = slots;
+	pool.depth = depth;
+	pool.sq = calloc(depth, sizeof(*pool.sq));
+	pool.cq = calloc(depth, sizeof(*pool.cq));
+	pool.offsets = calloc(depth, sizeof(*pool.offsets));
+	if (!pool.sq || !pool.cq || !pool.offsets)
+		return -ENOMEM;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.submitted, NULL);
+	/* Deadlines are in CLOCK_MONOTONIC, see now_ns(). */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool.completed, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (i = 0; i < depth; i++) {
+		int ret = pthread_create(&thread, NULL, pool_worker, NULL);
+
+		if (ret)
+			return -ret;
+		pthread_detach(thread);
+	}
+
+	return 0;
+}
+
+static int pool_submit(struct slot *slots, unsigned int index, __u64 offset)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.offsets[index] = offset;
+	pool.sq[pool.sq_tail++ % pool.depth] = index;
+	pthread_cond_signal(&pool.submitted);
+	pthread_mutex_unlock(&pool.lock);
+	return 0;
+}
+
+static int pool_reap(struct slot *slots, unsigned int *index, long long *res)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.cq_head != pool.cq_tail) {
+		*index = pool.cq[pool.cq_head++ % pool.depth];
+		*res = slots[*index].res;
+		found = 1;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return found;
+}
+
+static void pool_wait(unsigned long long deadline)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.cq_head == pool.cq_tail) {
+		if (deadline) {
+			ts.tv_sec = deadline / 1000000000ULL;
+			ts.tv_nsec = deadline % 1000000000ULL;
+			pthread_cond_timedwait(&pool.completed, &pool.lock,
+					       &ts);
+		} else {
+			pthread_cond_wait(&pool.completed, &pool.lock);
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static const struct engine pool_engine = {
+	.name = "threads",
+	.submit = pool_submit,
+	.reap = pool_reap,
+	.wait = pool_wait,
+};
+
+/* Set up io_uring, or the thread pool if the kernel does not have it. */
+static const struct engine *engine_setup(struct slot *slots,
+					 unsigned int depth)
+{
+	int ret;
+
+#ifdef HAVE_IO_URING
+	ret = uring_setup(depth);
+	if (!ret)
+		return &uring_engine;
+	if (ret != -ENOSYS) {
+		fprintf(stderr, "failed to set up io_uring: %s\n",
+			strerror(-ret));
+		return NULL;
+	}
+#endif
+
+	ret = pool_setup(slots, depth);
+	if (ret) {
+		fprintf(stderr, "failed to start the I/O threads: %s\n",
+			strerror(-ret));
+		return NULL;
+	}
+	return &pool_engine;
+}
+
+static int cmp_record(const void *a, const void *b)
+{
+	const struct nofscache_trace_record *ra = a, *rb = b;
+
+	return (ra->timestamp > rb->timestamp) -
+	       (ra->timestamp < rb->timestamp);
+}
+
+static struct test_file *find_file(__u32 dev, __u64 ino)
+{
+	size_t i;
+
+	for (i = 0; i < nfiles; i++)
+		if (files[i].dev == dev && files[i].ino == ino)
+			return &files[i];
+	return NULL;
+}
+
+/* Create the test file of each file in the trace and fill it with data. */
+static int prepare_files(const char *dir, struct nofscache_trace_record *recs,
+			 size_t nrecs)
+{
+	static char chunk[FILL_CHUNK];
+	struct test_file *f;
+	char path[4096];
+	struct stat st;
+	size_t i;
+
+	for (i = 0; i < nrecs; i++) {
+		f = find_file(recs[i].dev, recs[i].ino);
+		if (!f) {
+			f = realloc(files, (nfiles + 1) * sizeof(*files));
+			if (!f)
+				return -ENOMEM;
+			files = f;
+			f = &files[nfiles++];
+			f->dev = recs[i].dev;
+			f->ino = recs[i].ino;
+			f->size = 0;
+		}
+		if (recs[i].op == NOFSCACHE_TRACE_READ &&
+		    recs[i].offset + recs[i].len > f->size)
+			f->size = recs[i].offset + recs[i].len;
+	}
+
+	memset(chunk, 'a', sizeof(chunk));
+	for (i = 0; i < nfiles; i++) {
+		f = &files[i];
+		snprintf(path, sizeof(path), "%s/%u_%llu", dir, f->dev,
+			 (unsigned long long)f->ino);
+		f->fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (f->fd < 0 || fstat(f->fd, &st))
+			return -errno;
+
+		/* Holes would be read without any I/O to the device. */
+		while ((__u64)st.st_size < f->size) {
+			ssize_t ret = pwrite(f->fd, chunk, sizeof(chunk),
+					     st.st_size);
+
+			if (ret < 0)
+				return -errno;
+			st.st_size += ret;
+		}
+		fsync(f->fd);
+	}
+
+	return 0;
+}
+
+/* Issue the I/O of the record with a free slot. */
+static int issue(const struct engine *engine,
+		 struct nofscache_trace_record *rec, struct slot *slots)
+{
+	struct test_file *f = find_file(rec->dev, rec->ino);
+	struct slot *s = slots;
+
+	while (s->busy)
+		s++;
+
+	if (s->buf_size < rec->len) {
+		free(s->iov.iov_base);
+		s->iov.iov_base = malloc(rec->len);
+		if (!s->iov.iov_base)
+			return -ENOMEM;
+		memset(s->iov.iov_base, 'a', rec->len);
+		s->buf_size = rec->len;
+	}
+	s->iov.iov_len = rec->len;
+	s->fd = f->fd;
+	s->write = rec->op == NOFSCACHE_TRACE_WRITE;
+	s->issued = now_ns();
+	s->busy = 1;
+
+	return engine->submit(slots, s - slots, rec->offset);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s TRACE DIR [SPEED] [QUEUE_DEPTH]\n"
+		"TRACE\t\t: The trace file written by nofscache_record.\n"
+		"DIR\t\t: The directory of the test files.\n"
+		"SPEED\t\t: Replay SPEED times faster than recorded, or as fast\n"
+		"\t\t  as possible if 0. Default: 1\n"
+		"QUEUE_DEPTH\t: The max number of in-flight I/Os. Default: 32\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long start, first, lat_total = 0, lat_max = 0;
+	unsigned long long bytes = 0, late = 0, errors = 0;
+	struct nofscache_trace_record *recs;
+	unsigned int depth = 32, inflight = 0, index;
+	const struct engine *engine;
+	double speed = 1;
+	struct slot *slots;
+	size_t nrecs, i;
+	long long res;
+	struct stat st;
+	FILE *in;
+	int ret;
+
+	if (argc < 3) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (argc > 3)
+		speed = strtod(argv[3], NULL);
+	if (argc > 4)
+		depth = strtoul(argv[4], NULL, 10);
+	if (speed < 0 || !depth) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	in = fopen(argv[1], "r");
+	if (!in || fstat(fileno(in), &st)) {
+		perror(argv[1]);
+		return 2;
+	}
+	nrecs = st.st_size / sizeof(*recs);
+	recs = malloc(nrecs * sizeof(*recs) + 1);
+	if (!recs || fread(recs, sizeof(*recs), nrecs, in) != nrecs) {
+		fprintf(stderr, "failed to read %s\n", argv[1]);
+		return 2;
+	}
+	fclose(in);
+	if (!nrecs) {
+		fprintf(stderr, "%s is empty\n", argv[1]);
+		return 2;
+	}
+	qsort(recs, nrecs, sizeof(*recs), cmp_record);
+
+	ret = prepare_files(argv[2], recs, nrecs);
+	if (ret) {
+		fprintf(stderr, "failed to prepare the test files: %s\n",
+			strerror(-ret));
+		return 2;
+	}
+
+	slots = calloc(depth, sizeof(*slots));
+	if (!slots) {
+		perror("calloc");
+		return 2;
+	}
+
+	engine = engine_setup(slots, depth);
+	if (!engine)
+		return 2;
+
+	first = recs[0].timestamp;
+	start = now_ns();
+	for (i = 0; i < nrecs || inflight;) {
+		unsigned long long now;
+
+		/* Reap the completed I/Os. */
+		while (engine->reap(slots, &index, &res)) {
+			struct slot *s = &slots[index];
+			unsigned long long lat = now_ns() - s->issued;
+
+			if (res < 0)
+				errors++;
+			else
+				bytes += res;
+			lat_total += lat;
+			if (lat > lat_max)
+				lat_max = lat;
+			s->busy = 0;
+			inflight--;
+		}
+
+		if (i == nrecs || inflight == depth) {
+			if (inflight)
+				engine->wait(0);
+			continue;
+		}
+
+		now = now_ns();
+		if (speed > 0) {
+			unsigned long long due =
+				start + (recs[i].timestamp - first) / speed;
+
+			/*
+			 * Wake up for whichever comes first, a completion or
+			 * the record being due, so that it is not issued late.
+			 */
+			if (now < due) {
+				if (inflight)
+					engine->wait(due);
+				else
+					usleep((due - now) / 1000);
+				continue;
+			}
+			if (now - due > 1000000)
+				late++;
+		}
+
+		ret = issue(engine, &recs[i], slots);
+		if (ret) {
+			fprintf(stderr, "failed to submit: %s\n",
+				strerror(-ret));
+			return 3;
+		}
+		inflight++;
+		i++;
+	}
+
+	printf("engine=%s ios=%zu bytes=%llu errors=%llu late=%llu time=%.2fs avg_lat=%.1fus max_lat=%.1fus\n",
+	       engine->name, nrecs, bytes, errors, late,
+	       (now_ns() - start) / 1e9, lat_total / 1e3 / nrecs,
+	       lat_max / 1e3);
+
+	for (i = 0; i < nfiles; i++)
+		close(files[i].fd);
+	return 0;
+}